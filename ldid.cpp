@@ -21,20 +21,25 @@
 /* }}} */
 
 #include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <regex.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -43,6 +48,38 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#if !defined (__WIN32__) && !defined (_MSC_VER) && !defined (__MINGW32__)
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+# define LDID_SHA_X86
+# include <cpuid.h>
+# include <immintrin.h>
+#elif defined(__aarch64__) && defined(__AARCH64EL__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+# define LDID_SHA_ARM
+# define _crypto
+#elif defined(__aarch64__) && defined(__AARCH64EL__) && defined(__GNUC__) && !defined(__clang__)
+# define LDID_SHA_ARM
+# define _crypto __attribute__((target("+crypto")))
+#endif
+
+#ifdef LDID_SHA_ARM
+# include <arm_neon.h>
+# if defined(__linux__)
+#  include <sys/auxv.h>
+#  include <asm/hwcap.h>
+# elif defined(__FreeBSD__)
+#  include <sys/auxv.h>
+#  include <machine/elf.h>
+# endif
+#endif
 
 # if SMARTCARD
 #  define OPENSSL_SUPPRESS_DEPRECATED
@@ -128,6 +165,15 @@ std::string password = "";
 std::vector<std::string> cleanup;
 bool flag_H(false);
 const char *flag_t(NULL);
+unsigned flag_j(0);
+size_t flag_i(0);
+bool flag_v(false);
+bool flag_n(false);
+bool flag_A(false);
+std::set<std::pair<uint32_t, uint32_t>> flag_CPUTypes;
+// set with -p; larger pages mean fewer code slots in every CodeDirectory
+uint8_t flag_p(0x0c);
+uint32_t flag_PageSize(1 << flag_p);
 
 template <typename Type_>
 struct Iterator_ {
@@ -183,6 +229,9 @@ struct fat_header {
 #define FAT_MAGIC 0xcafebabe
 #define FAT_CIGAM 0xbebafeca
 
+#define FAT_MAGIC_64 0xcafebabf
+#define FAT_CIGAM_64 0xbfbafeca
+
 struct fat_arch {
     uint32_t cputype;
     uint32_t cpusubtype;
@@ -191,6 +240,15 @@ struct fat_arch {
     uint32_t align;
 } _packed;
 
+struct fat_arch_64 {
+    uint32_t cputype;
+    uint32_t cpusubtype;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t align;
+    uint32_t reserved;
+} _packed;
+
 struct mach_header {
     uint32_t magic;
     uint32_t cputype;
@@ -506,6 +564,27 @@ struct Progression : ldid::Progress {
     }
 };
 
+// workers report their progress one at a time
+struct Serialized : ldid::Progress {
+    const ldid::Progress &progress_;
+    mutable std::mutex mutex_;
+
+    Serialized(const ldid::Progress &progress) :
+        progress_(progress)
+    {
+    }
+
+    virtual void operator()(const std::string &value) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return progress_(value);
+    }
+
+    virtual void operator()(double value) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return progress_(value);
+    }
+};
+
 static std::streamsize read(std::streambuf &stream, void *data, size_t size) {
     auto writ(stream.sgetn(static_cast<char *>(data), size));
     _assert(writ >= 0);
@@ -538,6 +617,41 @@ static inline void put(std::streambuf &stream, const std::string &data) {
     return put(stream, data.data(), data.size());
 }
 
+struct Range {
+    const void *data_;
+    size_t size_;
+};
+
+// padding is written from here, however much of it there is
+static const char padding_[0x4000] = {};
+
+// an output that can take several ranges at once, so a file can be written
+// with one writev straight from wherever the pieces already are
+class GatherBuffer :
+    public std::streambuf
+{
+  public:
+    virtual void sputv(const Range *ranges, size_t count) {
+        for (size_t i(0); i != count; ++i)
+            put(*this, ranges[i].data_, ranges[i].size_);
+    }
+
+    // writes size zeros, which a file may leave as a hole instead
+    virtual void spad(size_t size) {
+        for (size_t writ; size != 0; size -= writ) {
+            writ = std::min(size, sizeof(padding_));
+            put(*this, padding_, writ);
+        }
+    }
+};
+
+static void put(std::streambuf &stream, const Range *ranges, size_t count) {
+    if (auto gather = dynamic_cast<GatherBuffer *>(&stream))
+        return gather->sputv(ranges, count);
+    for (size_t i(0); i != count; ++i)
+        put(stream, ranges[i].data_, ranges[i].size_);
+}
+
 static size_t most(std::streambuf &stream, void *data, size_t size) {
     size_t total(size);
     while (size > 0)
@@ -548,9 +662,12 @@ static size_t most(std::streambuf &stream, void *data, size_t size) {
 }
 
 static inline void pad(std::streambuf &stream, size_t size) {
-    char padding[size];
-    memset(padding, 0, size);
-    put(stream, padding, size);
+    if (auto gather = dynamic_cast<GatherBuffer *>(&stream))
+        return gather->spad(size);
+    for (size_t writ; size != 0; size -= writ) {
+        writ = std::min(size, sizeof(padding_));
+        put(stream, padding_, writ);
+    }
 }
 
 template <typename Type_>
@@ -561,9 +678,6 @@ Type_ Align(Type_ value, size_t align) {
     return value;
 }
 
-static const uint8_t PageShift_(0x0c);
-static const uint32_t PageSize_(1 << PageShift_);
-
 static inline unsigned bytes(uint64_t value) {
     if (!value) return 1;
     return (64 - __builtin_clzll(value) + 7) / 8;
@@ -796,6 +910,19 @@ class Swapped {
     }
 };
 
+// a file too large to be mapped as a whole is read through a window onto
+// it, which maps only the parts of it that are asked for
+class Window {
+  public:
+    // size bytes at offset, which stay mapped for as long as the window does
+    virtual const void *Pin(uint64_t offset, size_t size) = 0;
+    // size bytes at offset, which stay mapped only until the next call
+    virtual const void *Slide(uint64_t offset, size_t size) = 0;
+};
+
+// how much of a file a window maps at a time
+static const size_t Window_(0x1000000);
+
 class Data :
     public Swapped
 {
@@ -803,13 +930,19 @@ class Data :
     void *base_;
     size_t size_;
 
+    Window *window_;
+    uint64_t offset_;
+
   public:
-    Data(void *base, size_t size) :
+    Data(void *base, size_t size, Window *window = NULL, uint64_t offset = 0) :
         base_(base),
-        size_(size)
+        size_(size),
+        window_(window),
+        offset_(offset)
     {
     }
 
+    // through a window, only the headers are here
     void *GetBase() const {
         return base_;
     }
@@ -817,6 +950,29 @@ class Data :
     size_t GetSize() const {
         return size_;
     }
+
+    Window *GetWindow() const {
+        return window_;
+    }
+
+    bool Windowed() const {
+        return window_ != NULL;
+    }
+
+    // size bytes at offset, which stay where they are
+    const void *GetData(size_t offset, size_t size) const {
+        if (window_ == NULL)
+            return static_cast<const uint8_t *>(base_) + offset;
+        return window_->Pin(offset_ + offset, size);
+    }
+
+    // the same, for a run of code pages, which through a window is only
+    // there until the next run is asked for
+    const void *GetPages(size_t offset, size_t size) const {
+        if (window_ == NULL)
+            return static_cast<const uint8_t *>(base_) + offset;
+        return window_->Slide(offset_ + offset, size);
+    }
 };
 
 class MachHeader :
@@ -831,8 +987,8 @@ class MachHeader :
     uint32_t align_ = MAXSEGALIGN;
 
   public:
-    MachHeader(void *base, size_t size) :
-        Data(base, size)
+    MachHeader(void *base, size_t size, Window *window = NULL, uint64_t offset = 0) :
+        Data(base, size, window, offset)
     {
         mach_header_ = (mach_header *) base;
 
@@ -868,7 +1024,7 @@ class MachHeader :
         }
 
         uint32_t minalign = bits64_ ? MINSEGALIGN64 : MINSEGALIGN32;
-        ForSection(ldid::fun([&](const char *segment, void *lc, const char *section, void *, size_t) {
+        ForSection(ldid::fun([&](const char *segment, void *lc, const char *section, size_t, size_t) {
             if (section == NULL) {
                 uint64_t vmaddr = 0;
                 if (bits64_) {
@@ -939,23 +1095,24 @@ class MachHeader :
         return load_commands;
     }
 
-    void ForSection(const ldid::Functor<void (const char *, void *, const char *, void *, size_t)> &code) const {
+    // calls code with each segment and section, and where it is in the file
+    void ForSection(const ldid::Functor<void (const char *, void *, const char *, size_t, size_t)> &code) const {
         _foreach (load_command, GetLoadCommands())
             switch (Swap(load_command->cmd)) {
                 case LC_SEGMENT: {
                     auto segment(reinterpret_cast<struct segment_command *>(load_command));
-                    code(segment->segname, load_command, NULL, GetOffset<void>(segment->fileoff), segment->filesize);
+                    code(segment->segname, load_command, NULL, uint32_t(segment->fileoff), segment->filesize);
                     auto section(reinterpret_cast<struct section *>(segment + 1));
                     for (uint32_t i(0), e(Swap(segment->nsects)); i != e; ++i, ++section)
-                        code(segment->segname, load_command, section->sectname, GetOffset<void>(segment->fileoff + section->offset), section->size);
+                        code(segment->segname, load_command, section->sectname, uint32_t(segment->fileoff + section->offset), section->size);
                 } break;
 
                 case LC_SEGMENT_64: {
                     auto segment(reinterpret_cast<struct segment_command_64 *>(load_command));
-                    code(segment->segname, load_command, NULL, GetOffset<void>(segment->fileoff), segment->filesize);
+                    code(segment->segname, load_command, NULL, uint32_t(segment->fileoff), segment->filesize);
                     auto section(reinterpret_cast<struct section_64 *>(segment + 1));
                     for (uint32_t i(0), e(Swap(segment->nsects)); i != e; ++i, ++section)
-                        code(segment->segname, load_command, section->sectname, GetOffset<void>(segment->fileoff + section->offset), section->size);
+                        code(segment->segname, load_command, section->sectname, uint32_t(segment->fileoff + section->offset), section->size);
                 } break;
             }
     }
@@ -963,35 +1120,36 @@ class MachHeader :
     uint32_t GetAlign() const {
         return align_;
     }
-
-    template <typename Target_>
-    Target_ *GetOffset(uint32_t offset) const {
-        return reinterpret_cast<Target_ *>(offset + (uint8_t *) mach_header_);
-    }
 };
 
+// whether a slice is one of those chosen with -A or -arch, if any were
+static bool Chosen(const MachHeader &mach_header) {
+    return !flag_A || flag_CPUTypes.count(std::make_pair(mach_header.GetCPUType(), mach_header.GetCPUSubtype())) != 0;
+}
+
 class FatMachHeader :
     public MachHeader
 {
   private:
-    fat_arch *fat_arch_;
+    void *fat_arch_;
     uint32_t align_ = MAXSEGALIGN + 1;
 
   public:
-    FatMachHeader(void *base, size_t size, fat_arch *fat_arch) :
-        MachHeader(base, size),
+    FatMachHeader(void *base, size_t size, void *fat_arch, Window *window = NULL, uint64_t offset = 0) :
+        MachHeader(base, size, window, offset),
         fat_arch_(fat_arch)
     {
     }
 
-    FatMachHeader(void *base, size_t size, fat_arch *fat_arch, uint32_t align) :
-        MachHeader(base, size),
+    FatMachHeader(void *base, size_t size, void *fat_arch, uint32_t align, Window *window = NULL, uint64_t offset = 0) :
+        MachHeader(base, size, window, offset),
         fat_arch_(fat_arch),
         align_(align)
     {
     }
 
-    fat_arch *GetFatArch() const {
+    // either a fat_arch or a fat_arch_64, as the FatHeader says
+    void *GetFatArch() const {
         return fat_arch_;
     }
 
@@ -1007,40 +1165,120 @@ class FatHeader :
 {
   private:
     fat_header *fat_header_;
+    bool fat_;
+    bool bits64_;
     std::vector<FatMachHeader> mach_headers_;
 
-  public:
-    FatHeader(void *base, size_t size) :
-        Data(base, size)
-    {
-        fat_header_ = reinterpret_cast<struct fat_header *>(base);
+    // the fat_header and every fat_arch, if this is a universal binary
+    static void *Pin(Window &window) {
+        auto fat_header(static_cast<const struct fat_header *>(window.Pin(0, sizeof(struct fat_header))));
+        uint32_t count(fat_header->nfat_arch);
+        switch (fat_header->magic) {
+            case FAT_CIGAM: case FAT_CIGAM_64:
+                count = Swap_(count);
+            case FAT_MAGIC: case FAT_MAGIC_64:
+                break;
+            default:
+                count = 0;
+        }
+        return const_cast<void *>(window.Pin(0, sizeof(struct fat_header) + sizeof(struct fat_arch_64) * count));
+    }
+
+    // the mach_header of a slice and its load commands
+    void *Head(uint64_t offset) const {
+        auto window(GetWindow());
+        if (window == NULL)
+            return static_cast<uint8_t *>(GetBase()) + offset;
+
+        size_t size(sizeof(struct mach_header) + sizeof(uint32_t));
+        auto mach_header(static_cast<const struct mach_header *>(window->Pin(offset, size)));
+        switch (mach_header->magic) {
+            case MH_CIGAM: case MH_CIGAM_64:
+                size += Swap_(mach_header->sizeofcmds);
+            break;
+            case MH_MAGIC: case MH_MAGIC_64:
+                size += mach_header->sizeofcmds;
+            break;
+        }
+        return const_cast<void *>(window->Pin(offset, size));
+    }
 
-        if (Swap(fat_header_->magic) == FAT_CIGAM) {
+    void Parse() {
+        auto window(GetWindow());
+        fat_header_ = reinterpret_cast<struct fat_header *>(GetBase());
+
+        if (Swap(fat_header_->magic) == FAT_CIGAM || Swap(fat_header_->magic) == FAT_CIGAM_64) {
             swapped_ = !swapped_;
             goto fat;
-        } else if (Swap(fat_header_->magic) != FAT_MAGIC) {
+        } else if (Swap(fat_header_->magic) != FAT_MAGIC && Swap(fat_header_->magic) != FAT_MAGIC_64) {
             fat_header_ = NULL;
-            mach_headers_.push_back(FatMachHeader(base, size, NULL));
+            fat_ = false;
+            mach_headers_.push_back(FatMachHeader(Head(0), GetSize(), NULL, window, 0));
         } else fat: {
+            bits64_ = Swap(fat_header_->magic) == FAT_MAGIC_64;
             size_t fat_narch = Swap(fat_header_->nfat_arch);
-            fat_arch *fat_arch = reinterpret_cast<struct fat_arch *>(fat_header_ + 1);
-            size_t arch;
-            for (arch = 0; arch != fat_narch; ++arch) {
-                uint32_t arch_offset = Swap(fat_arch->offset);
-                uint32_t arch_size = Swap(fat_arch->size);
-                uint32_t align = Swap(fat_arch->align);
-                mach_headers_.push_back(FatMachHeader((uint8_t *) base + arch_offset, arch_size, fat_arch, align));
-                ++fat_arch;
+            if (bits64_) {
+                fat_arch_64 *fat_arch = reinterpret_cast<struct fat_arch_64 *>(fat_header_ + 1);
+                for (size_t arch(0); arch != fat_narch; ++arch) {
+                    uint64_t arch_offset = Swap(fat_arch->offset);
+                    uint64_t arch_size = Swap(fat_arch->size);
+                    uint32_t align = Swap(fat_arch->align);
+                    mach_headers_.push_back(FatMachHeader(Head(arch_offset), arch_size, fat_arch, align, window, arch_offset));
+                    ++fat_arch;
+                }
+            } else {
+                fat_arch *fat_arch = reinterpret_cast<struct fat_arch *>(fat_header_ + 1);
+                for (size_t arch(0); arch != fat_narch; ++arch) {
+                    uint32_t arch_offset = Swap(fat_arch->offset);
+                    uint32_t arch_size = Swap(fat_arch->size);
+                    uint32_t align = Swap(fat_arch->align);
+                    mach_headers_.push_back(FatMachHeader(Head(arch_offset), arch_size, fat_arch, align, window, arch_offset));
+                    ++fat_arch;
+                }
             }
         }
     }
 
+  public:
+    FatHeader(void *base, size_t size) :
+        Data(base, size),
+        fat_(true),
+        bits64_(false)
+    {
+        Parse();
+    }
+
+    // a file read through a window, of which only the headers are mapped
+    FatHeader(Window &window, size_t size) :
+        Data(Pin(window), size, &window),
+        fat_(true),
+        bits64_(false)
+    {
+        Parse();
+    }
+
+    // slices gathered from other files, to be written out together as a
+    // universal binary, or as a thin one if there is just one of them
+    FatHeader(const std::vector<FatMachHeader> &mach_headers) :
+        Data(NULL, 0),
+        fat_header_(NULL),
+        fat_(mach_headers.size() != 1),
+        bits64_(false),
+        mach_headers_(mach_headers)
+    {
+    }
+
+    // whether the slices are described by fat_arch_64
+    bool Bits64() const {
+        return bits64_;
+    }
+
     std::vector<FatMachHeader> &GetMachHeaders() {
         return mach_headers_;
     }
 
     bool IsFat() const {
-        return fat_header_ != NULL;
+        return fat_;
     }
 
     struct fat_header *operator ->() const {
@@ -1209,6 +1447,543 @@ enum MatchOperation {
 #define APPLE_EXTENSION_OID APPLE_ADS_OID, 6
 
 
+// OpenSSL 3 fetches the digest again on every one-shot SHA1()/SHA256(), and
+// hashing pages is where signing spends its time, so when the CPU has SHA
+// instructions (and they agree with OpenSSL) the compression is done here
+
+typedef void (*Transform)(uint32_t *state, const uint8_t *data, size_t blocks);
+
+static const uint32_t SHA256K_[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t SHA1Init_[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+};
+
+static const uint32_t SHA256Init_[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#if defined(LDID_SHA_X86)
+// 4 rounds per group; g is a literal, so the conditions and round function fold
+#define _sha1x86(g) { \
+    __m128i &e((g) % 2 == 0 ? e0 : e1); \
+    if ((g) < 4) \
+        msg[(g)] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + (g) * 16)), mask); \
+    if ((g) == 0) \
+        e = _mm_add_epi32(e, msg[0]); \
+    else \
+        e = _mm_sha1nexte_epu32(e, msg[(g) % 4]); \
+    ((g) % 2 == 0 ? e1 : e0) = abcd; \
+    if ((g) >= 3 && (g) <= 18) \
+        msg[((g) + 1) % 4] = _mm_sha1msg2_epu32(msg[((g) + 1) % 4], msg[(g) % 4]); \
+    abcd = _mm_sha1rnds4_epu32(abcd, e, (g) / 5); \
+    if ((g) >= 1 && (g) <= 16) \
+        msg[((g) + 3) % 4] = _mm_sha1msg1_epu32(msg[((g) + 3) % 4], msg[(g) % 4]); \
+    if ((g) >= 2 && (g) <= 17) \
+        msg[((g) + 2) % 4] = _mm_xor_si128(msg[((g) + 2) % 4], msg[(g) % 4]); \
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void SHA1X86(uint32_t *state, const uint8_t *data, size_t blocks) {
+    const __m128i mask(_mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL));
+
+    __m128i abcd(_mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0x1b));
+    __m128i e0(_mm_set_epi32(state[4], 0, 0, 0));
+    __m128i e1;
+    __m128i msg[4];
+
+    for (; blocks != 0; --blocks, data += 64) {
+        const __m128i abcd_(abcd);
+        const __m128i e0_(e0);
+
+        _sha1x86(0) _sha1x86(1) _sha1x86(2) _sha1x86(3) _sha1x86(4)
+        _sha1x86(5) _sha1x86(6) _sha1x86(7) _sha1x86(8) _sha1x86(9)
+        _sha1x86(10) _sha1x86(11) _sha1x86(12) _sha1x86(13) _sha1x86(14)
+        _sha1x86(15) _sha1x86(16) _sha1x86(17) _sha1x86(18) _sha1x86(19)
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_);
+        abcd = _mm_add_epi32(abcd, abcd_);
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+#undef _sha1x86
+
+#define _sha256x86(g) { \
+    if ((g) < 4) \
+        msg[(g)] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + (g) * 16)), mask); \
+    __m128i value(_mm_add_epi32(msg[(g) % 4], _mm_loadu_si128(reinterpret_cast<const __m128i *>(SHA256K_ + (g) * 4)))); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, value); \
+    if ((g) >= 3 && (g) <= 14) { \
+        msg[((g) + 1) % 4] = _mm_add_epi32(msg[((g) + 1) % 4], _mm_alignr_epi8(msg[(g) % 4], msg[((g) + 3) % 4], 4)); \
+        msg[((g) + 1) % 4] = _mm_sha256msg2_epu32(msg[((g) + 1) % 4], msg[(g) % 4]); \
+    } \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(value, 0x0e)); \
+    if ((g) >= 1 && (g) <= 12) \
+        msg[((g) + 3) % 4] = _mm_sha256msg1_epu32(msg[((g) + 3) % 4], msg[(g) % 4]); \
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void SHA256X86(uint32_t *state, const uint8_t *data, size_t blocks) {
+    const __m128i mask(_mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL));
+
+    __m128i temp(_mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0xb1));
+    __m128i state1(_mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4)), 0x1b));
+    __m128i state0(_mm_alignr_epi8(temp, state1, 8));
+    state1 = _mm_blend_epi16(state1, temp, 0xf0);
+
+    __m128i msg[4];
+
+    for (; blocks != 0; --blocks, data += 64) {
+        const __m128i state0_(state0);
+        const __m128i state1_(state1);
+
+        _sha256x86(0) _sha256x86(1) _sha256x86(2) _sha256x86(3)
+        _sha256x86(4) _sha256x86(5) _sha256x86(6) _sha256x86(7)
+        _sha256x86(8) _sha256x86(9) _sha256x86(10) _sha256x86(11)
+        _sha256x86(12) _sha256x86(13) _sha256x86(14) _sha256x86(15)
+
+        state0 = _mm_add_epi32(state0, state0_);
+        state1 = _mm_add_epi32(state1, state1_);
+    }
+
+    temp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_blend_epi16(temp, state1, 0xf0));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), _mm_alignr_epi8(state1, temp, 8));
+}
+
+#undef _sha256x86
+
+static bool HasSHA() {
+    unsigned a, b, c, d;
+    if (__get_cpuid(1, &a, &b, &c, &d) == 0)
+        return false;
+    if ((c & bit_SSSE3) == 0 || (c & bit_SSE4_1) == 0)
+        return false;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & (1 << 29)) != 0;
+}
+
+static Transform SHA1Transform_(SHA1X86);
+static Transform SHA256Transform_(SHA256X86);
+#elif defined(LDID_SHA_ARM)
+_crypto
+static void SHA1ARM(uint32_t *state, const uint8_t *data, size_t blocks) {
+    static const uint32_t k[4] = {0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6};
+
+    uint32x4_t abcd(vld1q_u32(state));
+    uint32_t e0(state[4]);
+    uint32x4_t msg[4];
+
+    for (; blocks != 0; --blocks, data += 64) {
+        const uint32x4_t abcd_(abcd);
+        const uint32_t e0_(e0);
+
+        for (unsigned g(0); g != 4; ++g)
+            msg[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + g * 16)));
+
+        for (unsigned g(0); g != 20; ++g) {
+            uint32x4_t value(vaddq_u32(msg[g % 4], vdupq_n_u32(k[g / 5])));
+            uint32_t e1(vsha1h_u32(vgetq_lane_u32(abcd, 0)));
+            if (g < 16)
+                msg[g % 4] = vsha1su1q_u32(vsha1su0q_u32(msg[g % 4], msg[(g + 1) % 4], msg[(g + 2) % 4]), msg[(g + 3) % 4]);
+            switch (g / 5) {
+                case 0: abcd = vsha1cq_u32(abcd, e0, value); break;
+                case 2: abcd = vsha1mq_u32(abcd, e0, value); break;
+                default: abcd = vsha1pq_u32(abcd, e0, value); break;
+            }
+            e0 = e1;
+        }
+
+        abcd = vaddq_u32(abcd, abcd_);
+        e0 += e0_;
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e0;
+}
+
+_crypto
+static void SHA256ARM(uint32_t *state, const uint8_t *data, size_t blocks) {
+    uint32x4_t state0(vld1q_u32(state));
+    uint32x4_t state1(vld1q_u32(state + 4));
+    uint32x4_t msg[4];
+
+    for (; blocks != 0; --blocks, data += 64) {
+        const uint32x4_t state0_(state0);
+        const uint32x4_t state1_(state1);
+
+        for (unsigned g(0); g != 4; ++g)
+            msg[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + g * 16)));
+
+        for (unsigned g(0); g != 16; ++g) {
+            uint32x4_t value(vaddq_u32(msg[g % 4], vld1q_u32(SHA256K_ + g * 4)));
+            if (g < 12)
+                msg[g % 4] = vsha256su1q_u32(vsha256su0q_u32(msg[g % 4], msg[(g + 1) % 4]), msg[(g + 2) % 4], msg[(g + 3) % 4]);
+            uint32x4_t save(state0);
+            state0 = vsha256hq_u32(state0, state1, value);
+            state1 = vsha256h2q_u32(state1, save, value);
+        }
+
+        state0 = vaddq_u32(state0, state0_);
+        state1 = vaddq_u32(state1, state1_);
+    }
+
+    vst1q_u32(state, state0);
+    vst1q_u32(state + 4, state1);
+}
+
+static bool HasSHA() {
+#if defined(__APPLE__)
+    return true;
+#elif defined(__linux__)
+    auto hwcap(getauxval(AT_HWCAP));
+    return (hwcap & HWCAP_SHA1) != 0 && (hwcap & HWCAP_SHA2) != 0;
+#elif defined(__FreeBSD__)
+    unsigned long hwcap(0);
+    if (elf_aux_info(AT_HWCAP, &hwcap, sizeof(hwcap)) != 0)
+        return false;
+    return (hwcap & HWCAP_SHA1) != 0 && (hwcap & HWCAP_SHA2) != 0;
+#else
+    return false;
+#endif
+}
+
+static Transform SHA1Transform_(SHA1ARM);
+static Transform SHA256Transform_(SHA256ARM);
+#else
+static bool HasSHA() {
+    return false;
+}
+
+static Transform SHA1Transform_(NULL);
+static Transform SHA256Transform_(NULL);
+#endif
+
+static void Digest(Transform transform, const uint32_t *init, size_t words, uint8_t *hash, const void *data, size_t size) {
+    uint32_t state[8];
+    memcpy(state, init, words * sizeof(uint32_t));
+
+    auto bytes(static_cast<const uint8_t *>(data));
+    transform(state, bytes, size / 64);
+
+    uint8_t last[128];
+    size_t left(size % 64);
+    size_t tail(left < 56 ? 64 : 128);
+    memcpy(last, bytes + size - left, left);
+    last[left] = 0x80;
+    memset(last + left + 1, 0, tail - left - 1);
+    for (size_t i(0); i != 8; ++i)
+        last[tail - 1 - i] = uint8_t((uint64_t(size) << 3) >> (i * 8));
+    transform(state, last, tail / 64);
+
+    for (size_t i(0); i != words; ++i) {
+        hash[i * 4 + 0] = uint8_t(state[i] >> 24);
+        hash[i * 4 + 1] = uint8_t(state[i] >> 16);
+        hash[i * 4 + 2] = uint8_t(state[i] >> 8);
+        hash[i * 4 + 3] = uint8_t(state[i]);
+    }
+}
+
+// the extensions are only used if they are present and produce the same
+// digests as OpenSSL over every tail length and a page; returns NULL if not
+static Transform Select(Transform transform, const uint32_t *init, size_t words, unsigned char *(*check)(const unsigned char *, size_t, unsigned char *)) {
+    if (transform == NULL || !HasSHA())
+        return NULL;
+
+    std::vector<uint8_t> data(0x1000 + 0x80);
+    for (size_t i(0); i != data.size(); ++i)
+        data[i] = uint8_t(i * 0x9d + (i >> 8));
+
+    for (size_t size(0); size <= data.size(); size += size < 0x100 ? 1 : 0x3f) {
+        uint8_t lhs[0x20], rhs[0x20];
+        Digest(transform, init, words, lhs, data.data(), size);
+        check(data.data(), size, rhs);
+        if (memcmp(lhs, rhs, words * 4) != 0) {
+            fprintf(stderr, "ldid: SHA self-test failed, falling back to OpenSSL\n");
+            return NULL;
+        }
+    }
+
+    return transform;
+}
+
+static Transform SHA1Transform() {
+    static const Transform transform(Select(SHA1Transform_, SHA1Init_, 5, &SHA1));
+    return transform;
+}
+
+static Transform SHA256Transform() {
+    static const Transform transform(Select(SHA256Transform_, SHA256Init_, 8, &SHA256));
+    return transform;
+}
+
+// code pages are independent messages of the same size, so without SHA
+// instructions several of them are hashed at once, one per SIMD lane
+
+#if defined(__x86_64__) || (defined(__aarch64__) && defined(__AARCH64EL__))
+# define LDID_SHA_LANES
+#endif
+
+typedef void (*Batch)(uint8_t *const *hashes, const uint8_t *const *data, size_t count, size_t size);
+
+struct Lanes {
+    size_t lanes_;
+    Batch batch_;
+};
+
+#ifdef LDID_SHA_LANES
+#ifdef LDID_SHA_X86
+typedef uint32_t Vector8 __attribute__((__vector_size__(32)));
+typedef uint32_t Vector16 __attribute__((__vector_size__(64)));
+#else
+typedef uint32_t Vector4 __attribute__((__vector_size__(16)));
+#endif
+
+#define _inline \
+    inline __attribute__((__always_inline__))
+
+#define _rotate(value, bits) \
+    (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+template <typename Vector_, size_t Lanes_>
+static _inline void Load(Vector_ *words, const uint8_t *const *data, size_t offset) {
+    for (size_t word(0); word != 16; ++word)
+        for (size_t lane(0); lane != Lanes_; ++lane) {
+            uint32_t value;
+            memcpy(&value, data[lane] + offset + word * 4, sizeof(value));
+            words[word][lane] = __builtin_bswap32(value);
+        }
+}
+
+template <typename Vector_, size_t Lanes_>
+static _inline void SHA1Blocks(Vector_ *state, const uint8_t *const *data, size_t blocks) {
+    for (size_t block(0); block != blocks; ++block) {
+        Vector_ w[16];
+        Load<Vector_, Lanes_>(w, data, block * 64);
+
+        Vector_ a(state[0]), b(state[1]), c(state[2]), d(state[3]), e(state[4]);
+
+        for (unsigned i(0); i != 80; ++i) {
+            if (i >= 16)
+                w[i % 16] = _rotate(w[(i + 13) % 16] ^ w[(i + 8) % 16] ^ w[(i + 2) % 16] ^ w[i % 16], 1);
+
+            Vector_ f;
+            uint32_t k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+
+            Vector_ t(_rotate(a, 5) + f + e + k + w[i % 16]);
+            e = d;
+            d = c;
+            c = _rotate(b, 30);
+            b = a;
+            a = t;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+}
+
+template <typename Vector_, size_t Lanes_>
+static _inline void SHA256Blocks(Vector_ *state, const uint8_t *const *data, size_t blocks) {
+    for (size_t block(0); block != blocks; ++block) {
+        Vector_ w[16];
+        Load<Vector_, Lanes_>(w, data, block * 64);
+
+        Vector_ a(state[0]), b(state[1]), c(state[2]), d(state[3]), e(state[4]), f(state[5]), g(state[6]), h(state[7]);
+
+        for (unsigned i(0); i != 64; ++i) {
+            if (i >= 16) {
+                Vector_ w15(w[(i + 1) % 16]), w2(w[(i + 14) % 16]);
+                w[i % 16] += (_rotate(w15, 25) ^ _rotate(w15, 14) ^ (w15 >> 3)) + w[(i + 9) % 16] + (_rotate(w2, 15) ^ _rotate(w2, 13) ^ (w2 >> 10));
+            }
+
+            Vector_ t1(h + (_rotate(e, 26) ^ _rotate(e, 21) ^ _rotate(e, 7)) + ((e & f) ^ (~e & g)) + SHA256K_[i] + w[i % 16]);
+            Vector_ t2((_rotate(a, 30) ^ _rotate(a, 19) ^ _rotate(a, 10)) + ((a & b) ^ (a & c) ^ (b & c)));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+template <typename Vector_, size_t Lanes_, size_t Words_, void (*Blocks_)(Vector_ *, const uint8_t *const *, size_t)>
+static _inline void Interleave(const uint32_t *init, uint8_t *const *hashes, const uint8_t *const *data, size_t count, size_t size) {
+    // unused lanes just hash the first message again
+    const uint8_t *lanes[Lanes_];
+    for (size_t lane(0); lane != Lanes_; ++lane)
+        lanes[lane] = data[lane < count ? lane : 0];
+
+    Vector_ state[Words_];
+    for (size_t word(0); word != Words_; ++word)
+        for (size_t lane(0); lane != Lanes_; ++lane)
+            state[word][lane] = init[word];
+
+    Blocks_(state, lanes, size / 64);
+
+    size_t left(size % 64);
+    size_t tail(left < 56 ? 64 : 128);
+    uint8_t last[Lanes_][128];
+    for (size_t lane(0); lane != Lanes_; ++lane) {
+        memcpy(last[lane], lanes[lane] + size - left, left);
+        last[lane][left] = 0x80;
+        memset(last[lane] + left + 1, 0, tail - left - 1);
+        for (size_t i(0); i != 8; ++i)
+            last[lane][tail - 1 - i] = uint8_t((uint64_t(size) << 3) >> (i * 8));
+        lanes[lane] = last[lane];
+    }
+
+    Blocks_(state, lanes, tail / 64);
+
+    for (size_t lane(0); lane != count; ++lane)
+        for (size_t word(0); word != Words_; ++word) {
+            uint32_t value(__builtin_bswap32(state[word][lane]));
+            memcpy(hashes[lane] + word * 4, &value, sizeof(value));
+        }
+}
+
+#ifdef LDID_SHA_X86
+__attribute__((target("avx2")))
+static void SHA1x8(uint8_t *const *hashes, const uint8_t *const *data, size_t count, size_t size) {
+    Interleave<Vector8, 8, 5, &SHA1Blocks<Vector8, 8>>(SHA1Init_, hashes, data, count, size);
+}
+
+__attribute__((target("avx2")))
+static void SHA256x8(uint8_t *const *hashes, const uint8_t *const *data, size_t count, size_t size) {
+    Interleave<Vector8, 8, 8, &SHA256Blocks<Vector8, 8>>(SHA256Init_, hashes, data, count, size);
+}
+
+__attribute__((target("avx512f")))
+static void SHA1x16(uint8_t *const *hashes, const uint8_t *const *data, size_t count, size_t size) {
+    Interleave<Vector16, 16, 5, &SHA1Blocks<Vector16, 16>>(SHA1Init_, hashes, data, count, size);
+}
+
+__attribute__((target("avx512f")))
+static void SHA256x16(uint8_t *const *hashes, const uint8_t *const *data, size_t count, size_t size) {
+    Interleave<Vector16, 16, 8, &SHA256Blocks<Vector16, 16>>(SHA256Init_, hashes, data, count, size);
+}
+#else
+static void SHA1x4(uint8_t *const *hashes, const uint8_t *const *data, size_t count, size_t size) {
+    Interleave<Vector4, 4, 5, &SHA1Blocks<Vector4, 4>>(SHA1Init_, hashes, data, count, size);
+}
+
+static void SHA256x4(uint8_t *const *hashes, const uint8_t *const *data, size_t count, size_t size) {
+    Interleave<Vector4, 4, 8, &SHA256Blocks<Vector4, 4>>(SHA256Init_, hashes, data, count, size);
+}
+#endif
+
+#undef _rotate
+#undef _inline
+
+#ifdef LDID_SHA_X86
+// four SSE lanes are no faster than OpenSSL's own SSSE3 code
+static Batch SHA1Batch_[3] = {NULL, &SHA1x8, &SHA1x16};
+static Batch SHA256Batch_[3] = {NULL, &SHA256x8, &SHA256x16};
+#else
+static Batch SHA1Batch_[3] = {&SHA1x4, NULL, NULL};
+static Batch SHA256Batch_[3] = {&SHA256x4, NULL, NULL};
+#endif
+#else
+static Batch SHA1Batch_[3] = {NULL, NULL, NULL};
+static Batch SHA256Batch_[3] = {NULL, NULL, NULL};
+#endif
+
+// batch holds the 4, 8 and 16 lane engines; like the single transforms, the
+// widest one the CPU runs must agree with OpenSSL on every lane to be used
+static Lanes Select(const Batch *batch, size_t words, unsigned char *(*check)(const unsigned char *, size_t, unsigned char *)) {
+    Lanes lanes = {4, batch[0]};
+#ifdef LDID_SHA_X86
+    __builtin_cpu_init();
+    if (batch[2] != NULL && __builtin_cpu_supports("avx512f"))
+        lanes = {16, batch[2]};
+    else if (batch[1] != NULL && __builtin_cpu_supports("avx2"))
+        lanes = {8, batch[1]};
+#endif
+    if (lanes.batch_ == NULL)
+        return {0, NULL};
+
+    std::vector<uint8_t> data(0x1000 + 0x80);
+    for (size_t i(0); i != data.size(); ++i)
+        data[i] = uint8_t(i * 0x9d + (i >> 8));
+
+    for (size_t size(0); size <= 0x1000; size += size < 0x100 ? 1 : 0x3f) {
+        const uint8_t *messages[16];
+        uint8_t hashes[16][0x20];
+        uint8_t *outputs[16];
+        for (size_t lane(0); lane != lanes.lanes_; ++lane) {
+            messages[lane] = data.data() + lane * 5 % 0x80;
+            outputs[lane] = hashes[lane];
+        }
+
+        lanes.batch_(outputs, messages, lanes.lanes_, size);
+
+        for (size_t lane(0); lane != lanes.lanes_; ++lane) {
+            uint8_t hash[0x20];
+            check(messages[lane], size, hash);
+            if (memcmp(hashes[lane], hash, words * 4) != 0) {
+                fprintf(stderr, "ldid: SHA self-test failed, falling back to OpenSSL\n");
+                return {0, NULL};
+            }
+        }
+    }
+
+    return lanes;
+}
+
+static const Lanes &SHA1Lanes() {
+    static const Lanes lanes(Select(SHA1Batch_, 5, &SHA1));
+    return lanes;
+}
+
+static const Lanes &SHA256Lanes() {
+    static const Lanes lanes(Select(SHA256Batch_, 8, &SHA256));
+    return lanes;
+}
+
 struct Algorithm {
     size_t size_;
     uint8_t type_;
@@ -1227,6 +2002,17 @@ struct Algorithm {
     virtual void operator ()(ldid::Hash &hash, const void *data, size_t size) const = 0;
     virtual void operator ()(std::vector<char> &hash, const void *data, size_t size) const = 0;
 
+    // hashes count messages of the same size; callers gather as many as
+    // lanes() says are hashed together
+    virtual void operator ()(uint8_t *const *hashes, const void *const *data, size_t count, size_t size) const {
+        for (size_t i(0); i != count; ++i)
+            operator ()(hashes[i], data[i], size);
+    }
+
+    virtual size_t lanes() const {
+        return 1;
+    }
+
     virtual const char *name() = 0;
 };
 
@@ -1243,6 +2029,8 @@ struct AlgorithmSHA1 :
     }
 
     void operator ()(uint8_t *hash, const void *data, size_t size) const {
+        if (auto transform = SHA1Transform())
+            return Digest(transform, SHA1Init_, 5, hash, data, size);
         SHA1(static_cast<const uint8_t *>(data), size, hash);
     }
 
@@ -1255,6 +2043,21 @@ struct AlgorithmSHA1 :
         return operator ()(reinterpret_cast<uint8_t *>(hash.data()), data, size);
     }
 
+    void operator ()(uint8_t *const *hashes, const void *const *data, size_t count, size_t size) const {
+        if (lanes() == 1)
+            return Algorithm::operator ()(hashes, data, count, size);
+        auto &engine(SHA1Lanes());
+        for (size_t i(0); i < count; i += engine.lanes_)
+            engine.batch_(hashes + i, reinterpret_cast<const uint8_t *const *>(data) + i, std::min(count - i, engine.lanes_), size);
+    }
+
+    size_t lanes() const {
+        auto &engine(SHA1Lanes());
+        if (engine.lanes_ < 16 && SHA1Transform() != NULL)
+            return 1;
+        return std::max<size_t>(engine.lanes_, 1);
+    }
+
     virtual const char *name() {
         return "sha1";
     }
@@ -1273,6 +2076,8 @@ struct AlgorithmSHA256 :
     }
 
     void operator ()(uint8_t *hash, const void *data, size_t size) const {
+        if (auto transform = SHA256Transform())
+            return Digest(transform, SHA256Init_, 8, hash, data, size);
         SHA256(static_cast<const uint8_t *>(data), size, hash);
     }
 
@@ -1285,6 +2090,21 @@ struct AlgorithmSHA256 :
         return operator ()(reinterpret_cast<uint8_t *>(hash.data()), data, size);
     }
 
+    void operator ()(uint8_t *const *hashes, const void *const *data, size_t count, size_t size) const {
+        if (lanes() == 1)
+            return Algorithm::operator ()(hashes, data, count, size);
+        auto &engine(SHA256Lanes());
+        for (size_t i(0); i < count; i += engine.lanes_)
+            engine.batch_(hashes + i, reinterpret_cast<const uint8_t *const *>(data) + i, std::min(count - i, engine.lanes_), size);
+    }
+
+    size_t lanes() const {
+        auto &engine(SHA256Lanes());
+        if (engine.lanes_ < 16 && SHA256Transform() != NULL)
+            return 1;
+        return std::max<size_t>(engine.lanes_, 1);
+    }
+
     virtual const char *name() {
         return "sha256";
     }
@@ -1292,38 +2112,146 @@ struct AlgorithmSHA256 :
 
 static bool do_sha1(true);
 static bool do_sha256(true);
+static std::atomic<bool> settled_(false);
 
+// the hashes are chosen by the first Mach-O signed and then kept for the
+// rest of the run
 static const std::vector<Algorithm *> &GetAlgorithms() {
     static AlgorithmSHA1 sha1;
     static AlgorithmSHA256 sha256;
 
-    static std::vector<Algorithm *> algorithms;
-    if (algorithms.empty()) {
+    static const std::vector<Algorithm *> algorithms([]() {
+        std::vector<Algorithm *> algorithms;
         if (do_sha1)
             algorithms.push_back(&sha1);
         if (do_sha256)
             algorithms.push_back(&sha256);
-    }
+        settled_ = true;
+        return algorithms;
+    }());
 
     return algorithms;
 }
 
-struct Baton {
-    std::string entitlements_;
-    std::string derformat_;
-};
+// files can only be signed at the same time once that choice is made, as
+// otherwise it would depend on which of them got there first
+static bool Settled() {
+    return settled_;
+}
 
-struct CodesignAllocation {
+static unsigned Threads() {
+    if (flag_j != 0)
+        return flag_j;
+    unsigned cores(std::thread::hardware_concurrency());
+    return cores == 0 ? 1 : cores;
+}
+
+// splits [0, count) into contiguous ranges of at least grain items and runs
+// each on its own thread; the calling thread takes the first range, and as
+// Progress is not thread safe only it is told it may report progress (true)
+// threads besides the ones that call Parallel are shared by all of them, so
+// nested calls (bundles within bundles, and the pages of each of their
+// files) use the cores left over instead of multiplying the threads
+static std::atomic<size_t> helpers_(0);
+
+static void Parallel(size_t count, size_t grain, const ldid::Functor<void (size_t, size_t, bool)> &code) {
+    size_t workers(std::min<size_t>(Threads(), (count + grain - 1) / grain));
+    if (workers <= 1)
+        return code(0, count, true);
+
+    size_t helpers(helpers_.load()), extra;
+    do extra = std::min(workers - 1, Threads() - 1 - std::min<size_t>(helpers, Threads() - 1));
+    while (!helpers_.compare_exchange_weak(helpers, helpers + extra));
+    _scope({ helpers_ -= extra; });
+
+    workers = extra + 1;
+    if (workers <= 1)
+        return code(0, count, true);
+
+    std::vector<std::thread> threads;
+#ifdef __EXCEPTIONS
+    // the first failure of any worker is thrown again once all are done
+    std::mutex mutex;
+    std::exception_ptr error;
+    for (size_t worker(1); worker != workers; ++worker)
+        threads.push_back(std::thread([&code, &mutex, &error, count, workers, worker]() {
+            try {
+                code(count * worker / workers, count * (worker + 1) / workers, false);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+        }));
+
+    try {
+        code(0, count / workers, true);
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error)
+            error = std::current_exception();
+    }
+
+    for (auto &thread : threads)
+        thread.join();
+
+    if (error)
+        std::rethrow_exception(error);
+#else
+    for (size_t worker(1); worker != workers; ++worker)
+        threads.push_back(std::thread([&code, count, workers, worker]() {
+            code(count * worker / workers, count * (worker + 1) / workers, false);
+        }));
+
+    code(0, count / workers, true);
+
+    for (auto &thread : threads)
+        thread.join();
+#endif
+}
+
+// how many pages are hashed and copied at a time, which through a window
+// must also fit in it
+static size_t Step(const Data &data) {
+    size_t step(0x100 * Threads());
+    if (data.Windowed())
+        step = std::min<size_t>(step, std::max<size_t>(1, Window_ / flag_PageSize));
+    return step;
+}
+
+struct Baton {
+    std::string entitlements_;
+    std::string derformat_;
+
+    // code page hashes per algorithm, filled in as the image is written
+    std::vector<std::vector<uint8_t>> hashes_;
+
+    // with -i, the old signature's hashes and how many pages they cover
+    std::vector<const uint8_t *> existing_;
+    std::vector<size_t> reuse_;
+
+    // each algorithm's hash of a page of zeros, and how many pages were
+    std::vector<std::vector<uint8_t>> zero_;
+    size_t zeros_;
+
+    Baton() :
+        zeros_(0)
+    {
+    }
+};
+
+struct CodesignAllocation {
     FatMachHeader mach_header_;
     uint64_t offset_;
-    uint32_t size_;
+    uint64_t size_;
     uint64_t limit_;
     uint32_t alloc_;
     uint32_t align_;
     const char *arch_;
     Baton baton_;
+    bool keep_;
 
-    CodesignAllocation(FatMachHeader mach_header, size_t offset, size_t size, size_t limit, size_t alloc, size_t align, const char *arch, const Baton &baton) :
+    CodesignAllocation(FatMachHeader mach_header, size_t offset, size_t size, size_t limit, size_t alloc, size_t align, const char *arch, const Baton &baton, bool keep) :
         mach_header_(mach_header),
         offset_(offset),
         size_(size),
@@ -1331,7 +2259,8 @@ struct CodesignAllocation {
         alloc_(alloc),
         align_(align),
         arch_(arch),
-        baton_(baton)
+        baton_(baton),
+        keep_(keep)
     {
     }
 };
@@ -1357,14 +2286,18 @@ class File {
         file_ = -1;
     }
 
-    void open(const char *path, int flags) {
-        file_ = ::open(path, flags);
+    void open(const char *path, int flags, mode_t mode = 0) {
+        file_ = ::open(path, flags, mode);
         if (file_ == -1) {
             fprintf(stderr, "ldid: %s: %s\n", path, strerror(errno));
             exit(1);
         }
     }
 
+    void open(int file) {
+        file_ = _syscall(dup(file));
+    }
+
     int file() const {
         return file_;
     }
@@ -1375,11 +2308,15 @@ class Map {
     File file_;
     void *data_;
     size_t size_;
+    size_t extent_;
+    uint64_t offset_;
 
   public:
     Map() :
         data_(NULL),
-        size_(0)
+        size_(0),
+        extent_(0),
+        offset_(0)
     {
     }
 
@@ -1412,6 +2349,7 @@ class Map {
         struct stat stat;
         _syscall(fstat(file, &stat));
         size_ = stat.st_size;
+        extent_ = size_;
 
 #ifdef MAP_RESILIENT_CODESIGN
         data_ = mmap(NULL, size_, pflag, mflag | MAP_RESILIENT_CODESIGN, file, 0);
@@ -1433,15 +2371,53 @@ class Map {
             open(path, O_RDONLY, PROT_READ, MAP_PRIVATE);
     }
 
+    // maps size bytes of file, which is end bytes long, from offset (a
+    // multiple of the page size); what is past the end of it reads as zeros
+    bool open(int file, uint64_t end, uint64_t offset, size_t size) {
+        clear();
+
+        extent_ = Align(std::max<size_t>(size, 1), getpagesize());
+        data_ = mmap(NULL, extent_, PROT_READ, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (data_ == MAP_FAILED) {
+            data_ = NULL;
+            extent_ = 0;
+            return false;
+        }
+
+        file_.open(file);
+        size_ = offset < end ? std::min<uint64_t>(size, end - offset) : 0;
+        offset_ = offset;
+
+        if (size_ == 0)
+            return true;
+
+#ifdef MAP_RESILIENT_CODESIGN
+        if (mmap(data_, size_, PROT_READ, MAP_PRIVATE | MAP_FIXED | MAP_RESILIENT_CODESIGN, file, offset) != MAP_FAILED)
+            return true;
+#endif
+
+        if (mmap(data_, size_, PROT_READ, MAP_PRIVATE | MAP_FIXED, file, offset) != MAP_FAILED)
+            return true;
+
+        clear();
+        return false;
+    }
+
     void clear() {
         if (data_ == NULL)
             return;
-        _syscall(munmap(data_, size_));
+        _syscall(munmap(data_, extent_));
         data_ = NULL;
         size_ = 0;
+        extent_ = 0;
+        offset_ = 0;
         file_.close();
     }
 
+    int file() const {
+        return file_.file();
+    }
+
     void *data() const {
         return data_;
     }
@@ -1450,10 +2426,180 @@ class Map {
         return size_;
     }
 
+    // how much is mapped, including any zeros past the end of the file
+    size_t extent() const {
+        return extent_;
+    }
+
+    // where in the file data() is from
+    uint64_t offset() const {
+        return offset_;
+    }
+
     operator std::string() const {
         return std::string(static_cast<char *>(data_), size_);
     }
 };
+
+// files up to this size are mapped whole, if they can be
+static const uint64_t Whole_(0x10000000);
+
+// a file to be signed, which is mapped whole if it is small enough and
+// otherwise read through a window onto it, so that files larger than the
+// address space can be signed; either way at least 0x10 bytes of zeros can be
+// read past the end of it, as if they were part of the file
+class Image :
+    public Window
+{
+  private:
+    File file_;
+    uint64_t size_;
+
+    Map whole_;
+    std::map<std::pair<uint64_t, size_t>, Map> pins_;
+    Map slide_;
+
+    static const void *At(const Map &map, uint64_t offset) {
+        return static_cast<const char *>(map.data()) + (offset - map.offset());
+    }
+
+  public:
+    Image(const std::string &path) {
+        file_.open(path.c_str(), O_RDONLY);
+
+        struct stat stat;
+        _syscall(fstat(file_.file(), &stat));
+        size_ = stat.st_size;
+
+        if (size_ <= Whole_)
+            whole_.open(file_.file(), size_, 0, size_ + 0x10);
+    }
+
+    uint64_t size() const {
+        return size_;
+    }
+
+    bool Windowed() const {
+        return whole_.empty();
+    }
+
+    // maps size bytes of the file from offset into map
+    void Read(Map &map, uint64_t offset, size_t size) {
+        uint64_t begin(offset / getpagesize() * getpagesize());
+        if (!map.open(file_.file(), size_, begin, offset - begin + size)) {
+            fprintf(stderr, "ldid: mmap: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    // whichever mapping the pages of the file are read from
+    const Map &map() const {
+        return whole_.empty() ? slide_ : whole_;
+    }
+
+    FatHeader Header(size_t size) {
+        if (!whole_.empty())
+            return FatHeader(whole_.data(), size);
+        return FatHeader(*this, size);
+    }
+
+    virtual const void *Pin(uint64_t offset, size_t size) {
+        if (!whole_.empty())
+            return At(whole_, offset);
+        auto &map(pins_[std::make_pair(offset, size)]);
+        if (map.empty())
+            Read(map, offset, size);
+        return At(map, offset);
+    }
+
+    virtual const void *Slide(uint64_t offset, size_t size) {
+        if (!whole_.empty())
+            return At(whole_, offset);
+        if (slide_.empty() || offset < slide_.offset() || offset - slide_.offset() + size > slide_.extent())
+            Read(slide_, offset, size);
+        return At(slide_, offset);
+    }
+
+    void clear() {
+        pins_.clear();
+        slide_.clear();
+        whole_.clear();
+        file_.close();
+    }
+};
+
+// reads a file from a mapping of it, which whoever takes it can also use as
+// it is rather than reading it all into memory of their own; a file that is
+// read through a window is instead mapped a window at a time as it is read
+class MapBuffer :
+    public std::streambuf
+{
+  private:
+    Image image_;
+    Map window_;
+
+    // what is read from here on starts at position
+    void Load(uint64_t position) {
+        if (!image_.Windowed()) {
+            auto data(static_cast<char *>(image_.map().data()));
+            setg(data, data + position, data + image_.size());
+            return;
+        }
+
+        if (position == image_.size()) {
+            window_.clear();
+            setg(NULL, NULL, NULL);
+            return;
+        }
+
+        uint64_t begin(position / Window_ * Window_);
+        image_.Read(window_, begin, std::min<uint64_t>(Window_, image_.size() - begin));
+        auto data(static_cast<char *>(window_.data()));
+        setg(data, data + (position - begin), data + window_.size());
+    }
+
+    uint64_t Position() const {
+        if (!image_.Windowed())
+            return gptr() - eback();
+        if (window_.empty())
+            return image_.size();
+        return window_.offset() + (gptr() - eback());
+    }
+
+  public:
+    MapBuffer(const std::string &path) :
+        image_(path)
+    {
+        Load(0);
+    }
+
+    virtual int_type underflow() {
+        if (gptr() == egptr() && !window_.empty())
+            Load(window_.offset() + window_.size());
+        if (gptr() == egptr())
+            return traits_type::eof();
+        return traits_type::to_int_type(*gptr());
+    }
+
+    virtual pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode which) {
+        if (direction == std::ios_base::cur)
+            offset += Position();
+        else if (direction == std::ios_base::end)
+            offset += image_.size();
+        if (offset < 0 || uint64_t(offset) > image_.size())
+            return pos_type(off_type(-1));
+        Load(offset);
+        return offset;
+    }
+
+    virtual pos_type seekpos(pos_type position, std::ios_base::openmode which) {
+        return seekoff(position, std::ios_base::beg, which);
+    }
+
+    Image &image() {
+        return image_;
+    }
+};
 #endif // LDID_NOTOOLS
 
 namespace ldid {
@@ -1465,23 +2611,22 @@ void Analyze(const MachHeader &mach_header, const Functor<void (const char *data
         if (mach_header.Swap(load_command->cmd) == LC_CODE_SIGNATURE) {
             auto signature(reinterpret_cast<struct linkedit_data_command *>(load_command));
             auto offset(mach_header.Swap(signature->dataoff));
-            auto pointer(reinterpret_cast<uint8_t *>(mach_header.GetBase()) + offset);
-            auto super(reinterpret_cast<struct SuperBlob *>(pointer));
+            auto pointer(static_cast<const uint8_t *>(mach_header.GetData(offset, mach_header.Swap(signature->datasize))));
+            auto super(reinterpret_cast<const struct SuperBlob *>(pointer));
 
             for (size_t index(0); index != Swap(super->count); ++index)
                 if (Swap(super->index[index].type) == CSSLOT_ENTITLEMENTS) {
                     auto begin(Swap(super->index[index].offset));
-                    auto blob(reinterpret_cast<struct Blob *>(pointer + begin));
+                    auto blob(reinterpret_cast<const struct Blob *>(pointer + begin));
                     auto writ(Swap(blob->length) - sizeof(*blob));
-                    entitle(reinterpret_cast<char *>(blob + 1), writ);
+                    entitle(reinterpret_cast<const char *>(blob + 1), writ);
                 }
         }
 }
 
-std::string Analyze(const void *data, size_t size) {
+static std::string Analyze(FatHeader &fat_header) {
     std::string entitlements;
 
-    FatHeader fat_header(const_cast<void *>(data), size);
     _foreach (mach_header, fat_header.GetMachHeaders())
         Analyze(mach_header, fun([&](const char *data, size_t size) {
             if (entitlements.empty())
@@ -1496,15 +2641,96 @@ std::string Analyze(const void *data, size_t size) {
     return entitlements;
 }
 
-static void Allocate(const void *idata, size_t isize, std::streambuf &output, const Functor<size_t (const MachHeader &, Baton &, size_t)> &allocate, const Functor<size_t (const MachHeader &, const Baton &, std::streambuf &output, size_t, size_t, size_t, const std::string &, const char *, const Progress &)> &save, const Progress &progress) {
-    FatHeader source(const_cast<void *>(idata), isize);
+std::string Analyze(const void *data, size_t size) {
+    FatHeader fat_header(const_cast<void *>(data), size);
+    return Analyze(fat_header);
+}
+
+// calls code with each blob of the embedded signature that lies within it
+static void ForBlob(const MachHeader &mach_header, const Functor<void (uint32_t, const struct Blob *, size_t)> &code) {
+    _foreach (load_command, mach_header.GetLoadCommands())
+        if (mach_header.Swap(load_command->cmd) == LC_CODE_SIGNATURE) {
+            auto signature(reinterpret_cast<struct linkedit_data_command *>(load_command));
+            size_t offset(mach_header.Swap(signature->dataoff));
+            size_t size(mach_header.Swap(signature->datasize));
+            if (offset + size > mach_header.GetSize() || size < sizeof(struct SuperBlob))
+                return;
+
+            auto pointer(static_cast<const uint8_t *>(mach_header.GetData(offset, size)));
+            auto super(reinterpret_cast<const struct SuperBlob *>(pointer));
+            if (Swap(super->blob.magic) != CSMAGIC_EMBEDDED_SIGNATURE || Swap(super->count) > (size - sizeof(*super)) / sizeof(struct BlobIndex))
+                return;
 
+            for (size_t index(0); index != Swap(super->count); ++index) {
+                size_t begin(Swap(super->index[index].offset));
+                if (begin + sizeof(struct Blob) > size)
+                    continue;
+                auto blob(reinterpret_cast<const struct Blob *>(pointer + begin));
+                size_t length(Swap(blob->length));
+                if (length < sizeof(struct Blob) || begin + length > size)
+                    continue;
+                code(Swap(super->index[index].type), blob, length);
+            }
+        }
+}
+
+// finds the page hashes an existing CodeDirectory made with this algorithm
+// and page size; count is how many whole pages of the old image they cover
+static const uint8_t *Existing(const MachHeader &mach_header, const Algorithm &algorithm, size_t &count) {
+    const uint8_t *existing(NULL);
+    count = 0;
+
+    ForBlob(mach_header, fun([&](uint32_t type, const struct Blob *blob, size_t length) {
+        if (existing != NULL || Swap(blob->magic) != CSMAGIC_CODEDIRECTORY)
+            return;
+        if (type != CSSLOT_CODEDIRECTORY && (type < CSSLOT_ALTERNATE || type >= CSSLOT_ALTERNATE + 5))
+            return;
+        if (length < sizeof(struct Blob) + sizeof(struct CodeDirectory))
+            return;
+
+        auto directory(reinterpret_cast<const struct CodeDirectory *>(blob + 1));
+        if (directory->hashType != algorithm.type_ || directory->hashSize != algorithm.size_ || directory->pageSize != flag_p)
+            return;
+
+        size_t hashes(Swap(directory->hashOffset));
+        size_t slots(Swap(directory->nCodeSlots));
+        if (hashes > length || slots > (length - hashes) / algorithm.size_)
+            return;
+
+        uint64_t limit(Swap(directory->codeLimit));
+        if (Swap(directory->version) >= 0x20300 && directory->codeLimit64 != 0)
+            limit = Swap(directory->codeLimit64);
+
+        count = std::min<uint64_t>(slots, limit / flag_PageSize);
+        existing = reinterpret_cast<const uint8_t *>(blob) + hashes;
+    }));
+
+    return existing;
+}
+
+static void Allocate(FatHeader &source, std::streambuf &output, const Functor<size_t (const MachHeader &, Baton &, size_t)> &allocate, const Functor<void (const MachHeader &, Baton &, size_t, const std::string &, size_t, size_t)> &hash, const Functor<size_t (const MachHeader &, const Baton &, std::streambuf &output, size_t, size_t, size_t, const std::string &, uint64_t, const Progress &)> &save, const Progress &progress, bool detached) {
+
+    // the output keeps fat_arch_64 if the input had it, and switches to it
+    // if any slice would no longer be reachable with 32 bits
+    bool bits64(source.Bits64());
     size_t offset(0);
     if (source.IsFat())
-        offset += sizeof(fat_header) + sizeof(fat_arch) * source.Swap(source->nfat_arch);
+        offset += sizeof(fat_header) + (bits64 ? sizeof(fat_arch_64) : sizeof(fat_arch)) * source.GetMachHeaders().size();
 
     std::vector<CodesignAllocation> allocations;
     _foreach (mach_header, source.GetMachHeaders()) {
+        // with -A, only the chosen slices are signed again, and the others are
+        // copied through as they are, along with any signature they have
+        if (!Chosen(mach_header)) {
+            size_t size(mach_header.GetSize());
+            uint32_t align(mach_header.GetAlign());
+            offset = Align(offset, 1 << align);
+            allocations.push_back(CodesignAllocation(mach_header, offset, size, size, 0, align, mach_header.GetCPUTypeString(), Baton(), true));
+            offset += size;
+            offset = Align(offset, 0x10);
+            continue;
+        }
+
         struct linkedit_data_command *signature(NULL);
         struct symtab_command *symtab(NULL);
 
@@ -1514,7 +2740,7 @@ static void Allocate(const void *idata, size_t isize, std::streambuf &output, co
                 signature = reinterpret_cast<struct linkedit_data_command *>(load_command);
             else if (cmd == LC_SYMTAB)
                 symtab = reinterpret_cast<struct symtab_command *>(load_command);
-            else if (flag_H == false) {
+            else if (flag_H == false && !Settled()) {
                 if (cmd == LC_BUILD_VERSION) {
                     do_sha1 = do_sha256 = true;
                     auto build = reinterpret_cast<struct build_version_command *>(load_command);
@@ -1547,14 +2773,18 @@ static void Allocate(const void *idata, size_t isize, std::streambuf &output, co
         }
 
         size_t size;
-        if (signature == NULL)
+        if (detached) {
+            // a detached signature covers the image exactly as it is stored
+            _assert_(signature == NULL, "cannot detach the signature of a signed binary; remove it with -r first");
+            size = mach_header.GetSize();
+        } else if (signature == NULL)
             size = mach_header.GetSize();
         else {
             size = mach_header.Swap(signature->dataoff);
             _assert(size <= mach_header.GetSize());
         }
 
-        if (symtab != NULL) {
+        if (!detached && symtab != NULL) {
             auto end(mach_header.Swap(symtab->stroff) + mach_header.Swap(symtab->strsize));
             if (symtab->stroff != 0 || symtab->strsize != 0) {
                 _assert(end <= size);
@@ -1562,10 +2792,13 @@ static void Allocate(const void *idata, size_t isize, std::streambuf &output, co
             }
         }
 
-        size = (size + 15) & ~(15);
+        if (!detached)
+            size = (size + 15) & ~(15);
 
         Baton baton;
         size_t alloc(allocate(mach_header, baton, size));
+        if (detached)
+            alloc = 0;
 
         uint32_t align;
 
@@ -1575,75 +2808,103 @@ static void Allocate(const void *idata, size_t isize, std::streambuf &output, co
 
         offset = Align(offset, 1 << align);
 
-        uint32_t limit(size);
-        if (alloc != 0)
+        size_t limit(size);
+        if (alloc != 0) {
             limit = Align(limit, 0x10);
+            // LC_CODE_SIGNATURE has only 32 bits for where the signature is
+            _assert_(uint32_t(limit) == limit, "cannot sign a slice with more than 4GiB of code");
+        }
 
-        allocations.push_back(CodesignAllocation(mach_header, offset, size, limit, alloc, align, arch, baton));
+        allocations.push_back(CodesignAllocation(mach_header, offset, size, limit, alloc, align, arch, baton, false));
         offset += size + alloc;
         offset = Align(offset, 0x10);
     }
 
+    // copying every slice through as it is would leave the file unsigned,
+    // and no hash to give for it
+    _assert_(!flag_A || std::find_if(allocations.begin(), allocations.end(), [](const CodesignAllocation &allocation) { return !allocation.keep_; }) != allocations.end(), "none of the slices were chosen with -A or -arch");
+
     size_t position(0);
 
+    if (source.IsFat() && !bits64) {
+        bool overflow(false);
+        _foreach (allocation, allocations)
+            if (allocation.offset_ + allocation.limit_ + allocation.alloc_ > UINT32_MAX)
+                overflow = true;
+
+        if (overflow) {
+            bits64 = true;
+            offset = sizeof(fat_header) + sizeof(fat_arch_64) * allocations.size();
+            for (auto &allocation : allocations) {
+                offset = Align(offset, 1 << allocation.align_);
+                allocation.offset_ = offset;
+                offset += allocation.limit_ + allocation.alloc_;
+                offset = Align(offset, 0x10);
+            }
+        }
+    }
+
     if (source.IsFat()) {
         fat_header fat_header;
-        fat_header.magic = Swap(FAT_MAGIC);
+        fat_header.magic = Swap(bits64 ? FAT_MAGIC_64 : FAT_MAGIC);
         fat_header.nfat_arch = Swap(uint32_t(allocations.size()));
         put(output, &fat_header, sizeof(fat_header));
         position += sizeof(fat_header);
 
-        // XXX: support fat_arch_64 (not in my toolchain)
-        // probably use C++14 generic lambda (not in my toolchain)
-
-        _assert_(![&]() {
-            _foreach (allocation, allocations) {
-                const auto offset(allocation.offset_);
-                const auto size(allocation.limit_ + allocation.alloc_);
-                if (uint32_t(offset) != offset || uint32_t(size) != size)
-                    return true;
-            }
-            return false;
-        }(), "FAT slice >=4GiB not currently supported");
-
         _foreach (allocation, allocations) {
             auto &mach_header(allocation.mach_header_);
 
-            fat_arch fat_arch;
-            fat_arch.cputype = Swap(mach_header.GetCPUType());
-            fat_arch.cpusubtype = Swap(mach_header.GetCPUSubtype());
-            fat_arch.offset = Swap(uint32_t(allocation.offset_));
-            fat_arch.size = Swap(uint32_t(allocation.limit_ + allocation.alloc_));
-            fat_arch.align = Swap(allocation.align_);
-            put(output, &fat_arch, sizeof(fat_arch));
-            position += sizeof(fat_arch);
+            if (bits64) {
+                fat_arch_64 fat_arch;
+                fat_arch.cputype = Swap(mach_header.GetCPUType());
+                fat_arch.cpusubtype = Swap(mach_header.GetCPUSubtype());
+                fat_arch.offset = Swap(uint64_t(allocation.offset_));
+                fat_arch.size = Swap(uint64_t(allocation.limit_ + allocation.alloc_));
+                fat_arch.align = Swap(allocation.align_);
+                fat_arch.reserved = Swap(uint32_t(0));
+                put(output, &fat_arch, sizeof(fat_arch));
+                position += sizeof(fat_arch);
+            } else {
+                fat_arch fat_arch;
+                fat_arch.cputype = Swap(mach_header.GetCPUType());
+                fat_arch.cpusubtype = Swap(mach_header.GetCPUSubtype());
+                fat_arch.offset = Swap(uint32_t(allocation.offset_));
+                fat_arch.size = Swap(uint32_t(allocation.limit_ + allocation.alloc_));
+                fat_arch.align = Swap(allocation.align_);
+                put(output, &fat_arch, sizeof(fat_arch));
+                position += sizeof(fat_arch);
+            }
         }
     }
 
-    _foreach (allocation, allocations) {
-        progress(allocation.arch_);
+    // the rewritten header is built once, both to be written and to be
+    // hashed in place of the start of the image
+    const auto rewrite([&](CodesignAllocation &allocation, std::string &overlap, size_t &body, size_t &left, size_t &right) {
         auto &mach_header(allocation.mach_header_);
+        left = -1;
+        right = 0;
 
-        pad(output, allocation.offset_ - position);
-        position = allocation.offset_;
-
-        size_t left(-1);
-        size_t right(0);
-
-        std::vector<std::string> commands;
+        overlap.assign(sizeof(struct mach_header), '\0');
+        if (mach_header.Bits64())
+            overlap.append(sizeof(uint32_t), '\0');
+        size_t prefix(overlap.size());
+        uint32_t ncmds(0);
 
         _foreach (load_command, mach_header.GetLoadCommands()) {
-            std::string copy(reinterpret_cast<const char *>(load_command), mach_header.Swap(load_command->cmdsize));
+            size_t offset(overlap.size());
+            overlap.append(reinterpret_cast<const char *>(load_command), mach_header.Swap(load_command->cmdsize));
+            auto copy(&overlap[offset]);
 
             switch (mach_header.Swap(load_command->cmd)) {
                 case LC_CODE_SIGNATURE:
+                    overlap.resize(offset);
                     continue;
                 break;
 
                 // XXX: this is getting ridiculous: provide a better abstraction
 
                 case LC_SEGMENT: {
-                    auto segment_command(reinterpret_cast<struct segment_command *>(&copy[0]));
+                    auto segment_command(reinterpret_cast<struct segment_command *>(copy));
 
                     if ((segment_command->initprot & 04) != 0) {
                         auto begin(mach_header.Swap(segment_command->fileoff));
@@ -1662,7 +2923,7 @@ static void Allocate(const void *idata, size_t isize, std::streambuf &output, co
                 } break;
 
                 case LC_SEGMENT_64: {
-                    auto segment_command(reinterpret_cast<struct segment_command_64 *>(&copy[0]));
+                    auto segment_command(reinterpret_cast<struct segment_command_64 *>(copy));
 
                     if ((segment_command->initprot & 04) != 0) {
                         auto begin(mach_header.Swap(segment_command->fileoff));
@@ -1681,7 +2942,7 @@ static void Allocate(const void *idata, size_t isize, std::streambuf &output, co
                 } break;
             }
 
-            commands.push_back(copy);
+            ++ncmds;
         }
 
         if (allocation.alloc_ != 0) {
@@ -1690,56 +2951,150 @@ static void Allocate(const void *idata, size_t isize, std::streambuf &output, co
             signature.cmdsize = mach_header.Swap(uint32_t(sizeof(signature)));
             signature.dataoff = mach_header.Swap(uint32_t(allocation.limit_));
             signature.datasize = mach_header.Swap(allocation.alloc_);
-            commands.push_back(std::string(reinterpret_cast<const char *>(&signature), sizeof(signature)));
+            overlap.append(reinterpret_cast<const char *>(&signature), sizeof(signature));
+            ++ncmds;
         }
 
-        size_t begin(position);
-
-        uint32_t after(0);
-        _foreach(command, commands)
-            after += command.size();
-
-        std::stringbuf altern;
+        uint32_t after(overlap.size() - prefix);
 
         struct mach_header header(*mach_header);
-        header.ncmds = mach_header.Swap(uint32_t(commands.size()));
+        header.ncmds = mach_header.Swap(ncmds);
         header.sizeofcmds = mach_header.Swap(after);
-        put(output, &header, sizeof(header));
-        put(altern, &header, sizeof(header));
-        position += sizeof(header);
+        memcpy(&overlap[0], &header, sizeof(header));
 
         if (mach_header.Bits64()) {
             auto pad(mach_header.Swap(uint32_t(0)));
-            put(output, &pad, sizeof(pad));
-            put(altern, &pad, sizeof(pad));
-            position += sizeof(pad);
-        }
-
-        _foreach(command, commands) {
-            put(output, command.data(), command.size());
-            put(altern, command.data(), command.size());
-            position += command.size();
+            memcpy(&overlap[sizeof(header)], &pad, sizeof(pad));
         }
 
         uint32_t before(mach_header.Swap(mach_header->sizeofcmds));
-        if (before > after) {
-            pad(output, before - after);
-            pad(altern, before - after);
-            position += before - after;
+        if (before > after)
+            overlap.append(before - after, '\0');
+
+        body = overlap.size();
+        size_t rest(std::max(body, std::min<size_t>(Align(body, flag_PageSize), allocation.size_)) - body);
+        if (rest != 0)
+            overlap.append(static_cast<const char *>(mach_header.GetData(body, rest)), rest);
+
+        // the pages are hashed as they would be written, which for a detached
+        // signature must also be as they already are
+        if (detached)
+            _assert_(memcmp(overlap.data(), mach_header.GetData(0, body), body) == 0, "cannot detach a signature from a binary whose load commands need to be rewritten");
+    });
+
+    // with several slices and threads, each slice is hashed and has its
+    // signature built on a worker of its own; as where every slice goes is
+    // already known, they are then written out in order from the input and
+    // the signatures kept in memory
+    // (through a window, the slices are read one at a time instead)
+    if (allocations.size() > 1 && Threads() > 1 && std::find_if(allocations.begin(), allocations.end(), [](const CodesignAllocation &allocation) { return allocation.mach_header_.Windowed(); }) == allocations.end()) {
+        struct Slice {
+            std::string overlap_;
+            size_t body_;
+            std::stringbuf signature_;
+            size_t saved_;
+        };
+
+        std::vector<Slice> slices(allocations.size());
+        Parallel(allocations.size(), 1, fun([&](size_t begin, size_t end, bool) {
+            for (size_t index(begin); index != end; ++index) {
+                auto &allocation(allocations[index]);
+                auto &slice(slices[index]);
+                auto &mach_header(allocation.mach_header_);
+                if (allocation.keep_)
+                    continue;
+
+                size_t left, right;
+                rewrite(allocation, slice.overlap_, slice.body_, left, right);
+
+                size_t pages((allocation.limit_ + flag_PageSize - 1) / flag_PageSize);
+                hash(mach_header, allocation.baton_, allocation.limit_, slice.overlap_, 0, pages);
+                slice.saved_ = save(mach_header, allocation.baton_, slice.signature_, allocation.limit_, left, right, slice.overlap_, allocation.offset_, dummy_);
+            }
+        }));
+
+        for (size_t index(0); index != allocations.size(); ++index) {
+            auto &allocation(allocations[index]);
+            auto &slice(slices[index]);
+            progress(allocation.arch_);
+
+            pad(output, allocation.offset_ - position);
+
+            auto top(reinterpret_cast<char *>(allocation.mach_header_.GetBase()));
+            if (allocation.keep_) {
+                Range range = {top, allocation.size_};
+                put(output, &range, 1);
+                position = allocation.offset_ + allocation.size_;
+                progress(1);
+                continue;
+            }
+
+            Range ranges[2] = {{slice.overlap_.data(), slice.body_}, {top + slice.body_, std::max<size_t>(allocation.size_, slice.body_) - slice.body_}};
+            put(output, ranges, 2);
+            pad(output, allocation.limit_ - allocation.size_);
+
+            put(output, slice.signature_.str());
+            if (allocation.alloc_ > slice.saved_)
+                pad(output, allocation.alloc_ - slice.saved_);
+            else
+                _assert(allocation.alloc_ == slice.saved_);
+
+            position = allocation.offset_ + allocation.limit_ + allocation.alloc_;
+            progress(1);
         }
 
-        auto top(reinterpret_cast<char *>(mach_header.GetBase()));
+        return;
+    }
+
+    for (auto &allocation : allocations) {
+        progress(allocation.arch_);
+        auto &mach_header(allocation.mach_header_);
 
-        std::string overlap(altern.str());
-        overlap.append(top + overlap.size(), Align(overlap.size(), 0x1000) - overlap.size());
+        pad(output, allocation.offset_ - position);
+        position = allocation.offset_;
 
-        put(output, top + (position - begin), allocation.size_ - (position - begin), progress);
+        if (allocation.keep_) {
+            for (size_t copied(0); copied != allocation.size_; ) {
+                size_t size(mach_header.Windowed() ? std::min(Window_, allocation.size_ - copied) : allocation.size_);
+                Range range = {static_cast<const char *>(mach_header.GetPages(copied, size)), size};
+                put(output, &range, 1);
+                copied += size;
+            }
+            position += allocation.size_;
+            continue;
+        }
+
+        size_t begin(position);
+
+        std::string overlap;
+        size_t body, left, right;
+        rewrite(allocation, overlap, body, left, right);
+        position += body;
+
+        // each run of pages is hashed just before it is copied out, so both
+        // read it while it is in cache and the image is only streamed once;
+        // the header goes out with the first run, in the same system call
+        size_t pages((allocation.limit_ + flag_PageSize - 1) / flag_PageSize);
+        size_t step(Step(mach_header));
+        progress(0);
+        for (size_t page(0); page < pages; page += step) {
+            size_t end(std::min(pages, page + step));
+            hash(mach_header, allocation.baton_, allocation.limit_, overlap, page, end);
+
+            size_t from(std::max(body, page * flag_PageSize));
+            size_t to(std::min<size_t>(allocation.size_, end * flag_PageSize));
+            Range ranges[2] = {{overlap.data(), page == 0 ? body : 0}, {overlap.data(), 0}};
+            if (from < to)
+                ranges[1] = {static_cast<const char *>(mach_header.GetPages(page * flag_PageSize, to - page * flag_PageSize)) + (from - page * flag_PageSize), to - from};
+            put(output, ranges, 2);
+            progress(double(end) / pages);
+        }
         position = begin + allocation.size_;
 
         pad(output, allocation.limit_ - allocation.size_);
         position += allocation.limit_ - allocation.size_;
 
-        size_t saved(save(mach_header, allocation.baton_, output, allocation.limit_, left, right, overlap, top, progress));
+        size_t saved(save(mach_header, allocation.baton_, output, allocation.limit_, left, right, overlap, allocation.offset_, progress));
         if (allocation.alloc_ > saved)
             pad(output, allocation.alloc_ - saved);
         else
@@ -1757,41 +3112,58 @@ static void insert(Blobs &blobs, uint32_t slot, const std::stringbuf &buffer) {
     std::swap(blobs[slot], value);
 }
 
-static const std::string &insert(Blobs &blobs, uint32_t slot, uint32_t magic, const std::stringbuf &buffer) {
-    auto value(buffer.str());
+// each blob is sized once and its header written in front of the data, so
+// nothing has to be moved to make room for it
+static std::string &insert(Blobs &blobs, uint32_t slot, uint32_t magic, size_t size) {
+    auto &save(blobs[slot]);
+    save.assign(sizeof(Blob) + size, '\0');
     Blob blob;
     blob.magic = Swap(magic);
-    blob.length = Swap(uint32_t(sizeof(blob) + value.size()));
-    value.insert(0, reinterpret_cast<char *>(&blob), sizeof(blob));
-    auto &save(blobs[slot]);
-    std::swap(save, value);
+    blob.length = Swap(uint32_t(sizeof(blob) + size));
+    memcpy(&save[0], &blob, sizeof(blob));
+    return save;
+}
+
+static const std::string &insert(Blobs &blobs, uint32_t slot, uint32_t magic, const void *data, size_t size) {
+    auto &save(insert(blobs, slot, magic, size));
+    memcpy(&save[sizeof(Blob)], data, size);
     return save;
 }
 
+static const std::string &insert(Blobs &blobs, uint32_t slot, uint32_t magic, const std::stringbuf &buffer) {
+    auto value(buffer.str());
+    return insert(blobs, slot, magic, value.data(), value.size());
+}
+
+// the SuperBlob header and index are put together, and then the blobs are
+// gathered into the output from where they are
 static size_t put(std::streambuf &output, uint32_t magic, const Blobs &blobs) {
     size_t total(0);
     _foreach (blob, blobs)
         total += blob.second.size();
 
+    std::string header(sizeof(SuperBlob) + sizeof(BlobIndex) * blobs.size(), '\0');
+
     struct SuperBlob super;
     super.blob.magic = Swap(magic);
-    super.blob.length = Swap(uint32_t(sizeof(SuperBlob) + blobs.size() * sizeof(BlobIndex) + total));
+    super.blob.length = Swap(uint32_t(header.size() + total));
     super.count = Swap(uint32_t(blobs.size()));
-    put(output, &super, sizeof(super));
+    memcpy(&header[0], &super, sizeof(super));
 
-    size_t offset(sizeof(SuperBlob) + sizeof(BlobIndex) * blobs.size());
+    size_t offset(header.size());
+    std::vector<Range> ranges(1, Range{header.data(), header.size()});
 
+    auto indices(reinterpret_cast<BlobIndex *>(&header[sizeof(SuperBlob)]));
     _foreach (blob, blobs) {
         BlobIndex index;
         index.type = Swap(blob.first);
         index.offset = Swap(uint32_t(offset));
-        put(output, &index, sizeof(index));
+        memcpy(indices++, &index, sizeof(index));
         offset += blob.second.size();
+        ranges.push_back(Range{blob.second.data(), blob.second.size()});
     }
 
-    _foreach (blob, blobs)
-        put(output, blob.second.data(), blob.second.size());
-
+    put(output, ranges.data(), ranges.size());
     return offset;
 }
 
@@ -2142,6 +3514,14 @@ class Signature {
 
   public:
     Signature(const ldid::Signer &signer, const Buffer &data, const std::string &xml, const ldid::Hash &hash) {
+#if SMARTCARD
+        // a token is not shared between threads
+        static std::mutex token;
+        std::unique_lock<std::mutex> lock(token, std::defer_lock);
+        if (dynamic_cast<const P11Signer *>(&signer) != NULL)
+            lock.lock();
+#endif
+
         value_ = PKCS7_new();
         if (value_ == NULL){
             fprintf(stderr, "ldid: An error occured while getting creating PKCS7 file: %s\n", ERR_error_string(ERR_get_error(), NULL));
@@ -2243,6 +3623,49 @@ class Signature {
     }
 };
 
+// a CMS from signer is the same size whatever it signs, but for the signature
+// value, which for keys such as ECDSA can come out a few bytes short; one is
+// made over nothing to measure it, for each signer and set of algorithms
+static size_t Certificate(const ldid::Signer &signer) {
+    static std::mutex mutex;
+    static std::map<std::pair<const ldid::Signer *, size_t>, size_t> sizes;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &size(sizes[std::make_pair(&signer, GetAlgorithms().size())]);
+    if (size != 0)
+        return size;
+
+    auto plist(plist_new_dict());
+    _scope({ plist_free(plist); });
+
+    auto cdhashes(plist_new_array());
+    plist_dict_set_item(plist, "cdhashes", cdhashes);
+
+    std::vector<char> cdhash(20);
+    for (size_t index(0); index != GetAlgorithms().size(); ++index)
+        plist_array_append_item(cdhashes, plist_new_data(cdhash.data(), cdhash.size()));
+
+    char *xml(NULL);
+    uint32_t length;
+    plist_to_xml(plist, &xml, &length);
+    _scope({ free(xml); });
+
+    ldid::Hash hash;
+    memset(&hash, 0, sizeof(hash));
+
+    Signature signature(signer, std::string(), std::string(xml, length), hash);
+    Buffer result(signature);
+    size = std::string(result).size();
+
+    auto info(sk_PKCS7_SIGNER_INFO_value(PKCS7_get_signer_info(signature), 0));
+    size_t most(EVP_PKEY_size(signer));
+    if (info != NULL && size_t(info->enc_digest->length) < most)
+        // the lengths of what encloses it may need a byte each more
+        size += most - info->enc_digest->length + 8;
+
+    return size;
+}
+
 class NullBuffer :
     public std::streambuf
 {
@@ -2256,6 +3679,67 @@ class NullBuffer :
     }
 };
 
+// a signing run hashes every file of a bundle, so the digests are looked up
+// once and their contexts are kept around for the next file instead of freed
+static const EVP_MD *FetchDigest(const char *name) {
+# if OPENSSL_VERSION_MAJOR >= 3
+    const EVP_MD *md(EVP_MD_fetch(NULL, name, NULL));
+# else
+    const EVP_MD *md(EVP_get_digestbyname(name));
+# endif
+    _assert_(md != NULL, "unknown digest: %s", name);
+    return md;
+}
+
+static const EVP_MD *DigestSHA1() {
+    static const EVP_MD *md(FetchDigest("sha1"));
+    return md;
+}
+
+static const EVP_MD *DigestSHA256() {
+    static const EVP_MD *md(FetchDigest("sha256"));
+    return md;
+}
+
+class DigestPool {
+  private:
+    std::mutex mutex_;
+    std::vector<EVP_MD_CTX *> contexts_;
+
+  public:
+    ~DigestPool() {
+        for (auto context : contexts_)
+            EVP_MD_CTX_free(context);
+    }
+
+    EVP_MD_CTX *Acquire(const EVP_MD *md) {
+        EVP_MD_CTX *context(NULL);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!contexts_.empty()) {
+                context = contexts_.back();
+                contexts_.pop_back();
+            }
+        }
+
+        if (context == NULL)
+            context = EVP_MD_CTX_new();
+        _assert(context != NULL);
+        _assert(EVP_DigestInit_ex(context, md, NULL) == 1);
+        return context;
+    }
+
+    void Release(EVP_MD_CTX *context) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        contexts_.push_back(context);
+    }
+};
+
+static DigestPool &GetDigestPool() {
+    static DigestPool pool;
+    return pool;
+}
+
 class HashBuffer :
     public std::streambuf
 {
@@ -2265,38 +3749,72 @@ class HashBuffer :
     EVP_MD_CTX *sha1_;
     EVP_MD_CTX *sha256_;
 
+    char data_[0x4000];
+
+  protected:
+    virtual void Update(const char *data, size_t size) {
+        EVP_DigestUpdate(sha1_, data, size);
+        EVP_DigestUpdate(sha256_, data, size);
+    }
+
+    // subclasses must call this in their destructor, as by the time ours
+    // runs their Update has already been replaced by the one above; errors
+    // can't be thrown from there, so writers should pubsync() when done
+    void Flush() {
+        if (auto size = pptr() - pbase())
+            Update(pbase(), size);
+        setp(data_, data_ + sizeof(data_));
+    }
+
   public:
     HashBuffer(ldid::Hash &hash) :
         hash_(hash)
     {
-        sha1_ = EVP_MD_CTX_new();
-        sha256_ = EVP_MD_CTX_new();
-
-        EVP_DigestInit_ex(sha1_, EVP_get_digestbyname("sha1"), nullptr);
-        EVP_DigestInit_ex(sha256_, EVP_get_digestbyname("sha256"), nullptr);
+        auto &pool(GetDigestPool());
+        sha1_ = pool.Acquire(DigestSHA1());
+        sha256_ = pool.Acquire(DigestSHA256());
+        setp(data_, data_ + sizeof(data_));
     }
 
     ~HashBuffer() {
+        Flush();
+
         EVP_DigestFinal_ex(sha1_, reinterpret_cast<uint8_t *>(hash_.sha1_), nullptr);
         EVP_DigestFinal_ex(sha256_, reinterpret_cast<uint8_t *>(hash_.sha256_), nullptr);
 
-        EVP_MD_CTX_free(sha1_);
-        EVP_MD_CTX_free(sha256_);
+        auto &pool(GetDigestPool());
+        pool.Release(sha1_);
+        pool.Release(sha256_);
     }
 
     virtual std::streamsize xsputn(const char_type *data, std::streamsize size) {
-        EVP_DigestUpdate(sha1_, data, size);
-        EVP_DigestUpdate(sha256_, data, size);
+        if (size <= epptr() - pptr()) {
+            memcpy(pptr(), data, size);
+            pbump(size);
+        } else {
+            Flush();
+            if (size < epptr() - pptr()) {
+                memcpy(pptr(), data, size);
+                pbump(size);
+            } else
+                Update(data, size);
+        }
         return size;
     }
 
     virtual int_type overflow(int_type next) {
+        Flush();
         if (next == traits_type::eof())
-            return sync();
-        char value(next);
-        xsputn(&value, 1);
+            return traits_type::not_eof(next);
+        *pptr() = traits_type::to_char_type(next);
+        pbump(1);
         return next;
     }
+
+    virtual int sync() {
+        Flush();
+        return 0;
+    }
 };
 
 class HashProxy :
@@ -2304,17 +3822,34 @@ class HashProxy :
 {
   private:
     std::streambuf &buffer_;
+    bool failed_;
+
+  protected:
+    // this also runs from our destructor, maybe while unwinding, so a short
+    // write is only noted here and reported by the next sync()
+    virtual void Update(const char *data, size_t size) {
+        HashBuffer::Update(data, size);
+        if (buffer_.sputn(data, size) != static_cast<std::streamsize>(size))
+            failed_ = true;
+    }
 
   public:
     HashProxy(ldid::Hash &hash, std::streambuf &buffer) :
         HashBuffer(hash),
-        buffer_(buffer)
+        buffer_(buffer),
+        failed_(false)
     {
     }
 
-    virtual std::streamsize xsputn(const char_type *data, std::streamsize size) {
-        _assert(HashBuffer::xsputn(data, size) == size);
-        return buffer_.sputn(data, size);
+    ~HashProxy() {
+        Flush();
+    }
+
+    virtual int sync() {
+        Flush();
+        if (failed_)
+            return -1;
+        return buffer_.pubsync();
     }
 };
 
@@ -2363,10 +3898,237 @@ static void mkdir_p(const std::string &path) {
     mkdir_p(path.substr(0, slash));
 }
 
-static std::string Temporary(std::filebuf &file, const Split &split) {
+// small writes are collected and go out with the next large one, which is
+// written from where it is rather than copied into a buffer first; where a
+// large one is part of a mapped source, the kernel is asked to share or copy
+// its extents instead
+class FileBuffer :
+    public GatherBuffer
+{
+  private:
+    File file_;
+    char data_[0x10000];
+
+    off_t offset_;
+    std::vector<const Map *> sources_;
+
+#ifdef __linux__
+    off_t block_;
+    bool clone_;
+    bool copy_;
+#endif
+
+#if !defined (__WIN32__) && !defined (_MSC_VER) && !defined (__MINGW32__)
+    void Write(std::vector<struct iovec> &vectors) {
+        for (size_t index(0); index != vectors.size(); ) {
+            size_t writ(_syscall(::writev(file_.file(), &vectors[index], std::min<size_t>(vectors.size() - index, IOV_MAX))));
+            offset_ += writ;
+            for (; index != vectors.size() && writ >= vectors[index].iov_len; ++index)
+                writ -= vectors[index].iov_len;
+            if (writ != 0) {
+                vectors[index].iov_base = static_cast<char *>(vectors[index].iov_base) + writ;
+                vectors[index].iov_len -= writ;
+            }
+        }
+
+        vectors.clear();
+    }
+#endif
+
+#ifdef __linux__
+    // FICLONERANGE needs whole blocks at the same alignment in both files,
+    // so whatever is around them is copied
+    void Clone(int file, off_t from, const char *data, size_t size) {
+#ifdef FICLONERANGE
+        if (clone_ && from % block_ == offset_ % block_) {
+            size_t head(std::min<size_t>(size, (block_ - offset_ % block_) % block_));
+            size_t body((size - head) / block_ * block_);
+            if (body != 0) {
+                Copy(file, from, data, head);
+
+                struct file_clone_range range;
+                range.src_fd = file;
+                range.src_offset = from + head;
+                range.src_length = body;
+                range.dest_offset = offset_;
+
+                if (_syscall(ioctl(file_.file(), FICLONERANGE, &range), EOPNOTSUPP, ENOTTY, EXDEV, EINVAL, EPERM) >= 0) {
+                    offset_ += body;
+                    _syscall(lseek(file_.file(), offset_, SEEK_SET));
+                    return Copy(file, from + head + body, data + head + body, size - head - body);
+                }
+
+                clone_ = false;
+                return Copy(file, from + head, data + head, size - head);
+            }
+        }
+#endif
+
+        Copy(file, from, data, size);
+    }
+
+    // copy_file_range takes anything, but may refuse across filesystems, in
+    // which case what is left is written from the mapping
+    void Copy(int file, off_t from, const char *data, size_t size) {
+        while (copy_ && size != 0) {
+            auto writ(_syscall(syscall(SYS_copy_file_range, file, &from, file_.file(), NULL, size, 0), ENOSYS, EXDEV, EINVAL, EOPNOTSUPP, EBADF));
+            if (writ <= 0) {
+                if (writ != 0)
+                    copy_ = false;
+                break;
+            }
+
+            offset_ += writ;
+            data += writ;
+            size -= writ;
+        }
+
+        std::vector<struct iovec> vectors;
+        if (size != 0)
+            vectors.push_back({const_cast<char *>(data), size});
+        Write(vectors);
+    }
+
+    bool Source(const Range &range, int &file, off_t &from) const {
+        auto data(static_cast<const char *>(range.data_));
+        for (auto source : sources_) {
+            auto base(static_cast<const char *>(source->data()));
+            if (base != NULL && data >= base && range.size_ <= source->size() && size_t(data - base) <= source->size() - range.size_) {
+                file = source->file();
+                from = source->offset() + (data - base);
+                return true;
+            }
+        }
+
+        return false;
+    }
+#endif
+
+  public:
+    FileBuffer() :
+        offset_(0)
+    {
+    }
+
+    void open(const char *path) {
+        int flags(O_WRONLY | O_CREAT | O_TRUNC);
+#ifdef O_BINARY
+        flags |= O_BINARY;
+#endif
+        file_.open(path, flags, 0666);
+        setp(data_, data_ + sizeof(data_));
+        offset_ = 0;
+
+#ifdef __linux__
+        struct stat info;
+        _syscall(fstat(file_.file(), &info));
+        block_ = info.st_blksize == 0 ? 0x1000 : info.st_blksize;
+        clone_ = true;
+        copy_ = true;
+#endif
+    }
+
+    // ranges of what is written that lie in source may be taken from its file
+    void source(const Map &source) {
+        sources_.push_back(&source);
+    }
+
+    void close() {
+        if (file_.file() == -1)
+            return;
+        sputv(NULL, 0);
+
+        // a hole at the end is only there once the file is as long as it
+        struct stat info;
+        _syscall(fstat(file_.file(), &info));
+        if (info.st_size < offset_)
+            _syscall(ftruncate(file_.file(), offset_));
+
+        file_.close();
+    }
+
+    // padding that would not fit in what is buffered is sought over
+    virtual void spad(size_t size) {
+        if (size <= size_t(epptr() - pptr())) {
+            memset(pptr(), 0, size);
+            pbump(size);
+            return;
+        }
+
+        sputv(NULL, 0);
+        offset_ += size;
+        _syscall(lseek(file_.file(), offset_, SEEK_SET));
+    }
+
+    virtual void sputv(const Range *ranges, size_t count) {
+#if defined (__WIN32__) || defined (_MSC_VER) || defined (__MINGW32__)
+        std::vector<Range> writes;
+        if (pptr() != pbase())
+            writes.push_back({pbase(), size_t(pptr() - pbase())});
+        writes.insert(writes.end(), ranges, ranges + count);
+
+        for (const auto &range : writes) {
+            for (size_t total(0); total != range.size_; )
+                total += _syscall(::write(file_.file(), static_cast<const char *>(range.data_) + total, range.size_ - total));
+            offset_ += range.size_;
+        }
+#else
+        std::vector<struct iovec> vectors;
+        if (pptr() != pbase())
+            vectors.push_back({pbase(), size_t(pptr() - pbase())});
+        for (size_t i(0); i != count; ++i) {
+            if (ranges[i].size_ == 0)
+                continue;
+#ifdef __linux__
+            int file;
+            off_t from;
+            if (ranges[i].size_ >= sizeof(data_) && Source(ranges[i], file, from)) {
+                Write(vectors);
+                Clone(file, from, static_cast<const char *>(ranges[i].data_), ranges[i].size_);
+                continue;
+            }
+#endif
+            vectors.push_back({const_cast<void *>(ranges[i].data_), ranges[i].size_});
+        }
+
+        Write(vectors);
+#endif
+
+        setp(data_, data_ + sizeof(data_));
+    }
+
+    virtual std::streamsize xsputn(const char_type *data, std::streamsize size) {
+        if (size <= epptr() - pptr()) {
+            memcpy(pptr(), data, size);
+            pbump(size);
+        } else {
+            Range range = {data, size_t(size)};
+            sputv(&range, 1);
+        }
+        return size;
+    }
+
+    virtual int_type overflow(int_type next) {
+        sputv(NULL, 0);
+        if (next == traits_type::eof())
+            return traits_type::not_eof(next);
+        *pptr() = traits_type::to_char_type(next);
+        pbump(1);
+        return next;
+    }
+
+    virtual int sync() {
+        sputv(NULL, 0);
+        return 0;
+    }
+};
+
+static std::string Temporary(FileBuffer &file, const Split &split) {
     std::string temp(split.dir + ".ldid." + split.base);
     mkdir_p(split.dir);
-    _assert_(file.open(temp.c_str(), std::ios::out | std::ios::trunc | std::ios::binary) == &file, "open(): %s", temp.c_str());
+    file.open(temp.c_str());
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
     cleanup.push_back(temp);
     return temp;
 }
@@ -2384,9 +4146,211 @@ static void Commit(const std::string &path, const std::string &temp) {
 #endif
     }
 
-    _syscall(rename(temp.c_str(), path.c_str()));
-    cleanup.erase(std::remove(cleanup.begin(), cleanup.end(), temp), cleanup.end());
-}
+    _syscall(rename(temp.c_str(), path.c_str()));
+    cleanup.erase(std::remove(cleanup.begin(), cleanup.end(), temp), cleanup.end());
+}
+
+// stands in for the Temporary of path while what is written matches what
+// path already holds; only at the first difference is the temporary opened
+// and the matching prefix copied into it, so an unchanged file is left alone;
+// with -n, small differences, such as a new signature where the old one was,
+// are instead kept to be patched into path in place, until they grow too
+// large or the file has to grow
+class CompareBuffer :
+    public GatherBuffer
+{
+  private:
+    std::string path_;
+    Map map_;
+    size_t offset_;
+
+    bool patch_;
+    std::vector<std::pair<size_t, std::string>> patches_;
+    size_t patched_;
+
+    const Map *same_;
+
+    FileBuffer file_;
+    std::string temp_;
+
+    void Diverge() {
+        temp_ = Temporary(file_, path_);
+        file_.source(map_);
+
+        auto data(static_cast<const char *>(map_.data()));
+        size_t from(0);
+        for (const auto &patch : patches_) {
+            put(file_, data + from, patch.first - from);
+            put(file_, patch.second);
+            from = patch.first + patch.second.size();
+        }
+        put(file_, data + from, offset_ - from);
+
+        patches_.clear();
+        map_.clear();
+    }
+
+    // a range of a mapping of path itself, going back where it came from
+    bool Same(const char *data, size_t size) const {
+        if (same_ == NULL || size > map_.size() - offset_)
+            return false;
+        auto base(static_cast<const char *>(same_->data()));
+        return base != NULL && data >= base && data + size <= base + same_->size() && same_->offset() + (data - base) == offset_;
+    }
+
+    bool Patch(const char *data, size_t size) {
+        if (!patch_ || size > map_.size() - offset_)
+            return false;
+
+        auto base(static_cast<const char *>(map_.data()) + offset_);
+        size_t begin(0), end(size);
+        while (begin != end && base[begin] == data[begin])
+            ++begin;
+        while (end != begin && base[end - 1] == data[end - 1])
+            --end;
+
+        if (begin != end) {
+            if (patched_ + (end - begin) > map_.size() / 4)
+                return false;
+            patched_ += end - begin;
+            patches_.emplace_back(offset_ + begin, std::string(data + begin, end - begin));
+        }
+
+        offset_ += size;
+        return true;
+    }
+
+    // this is not atomic: the patches go in last to first, each synced before
+    // the next, so the whole new signature is on disk before the load
+    // commands that point at it change, but a crash in between leaves a file
+    // whose signature does not match until it is signed again
+    void Apply() {
+        map_.clear();
+
+        struct stat info;
+        _syscall(stat(path_.c_str(), &info));
+
+        if (!patches_.empty()) {
+            Map edit(path_, true);
+            auto data(static_cast<char *>(edit.data()));
+            size_t size(getpagesize());
+            for (auto patch(patches_.rbegin()); patch != patches_.rend(); ++patch) {
+                memcpy(data + patch->first, patch->second.data(), patch->second.size());
+                auto page(patch->first / size * size);
+                _syscall(msync(data + page, patch->first + patch->second.size() - page, MS_SYNC));
+            }
+        }
+
+        if (offset_ != size_t(info.st_size))
+            _syscall(truncate(path_.c_str(), offset_));
+    }
+
+  public:
+    CompareBuffer(const std::string &path) :
+        path_(path),
+        offset_(0),
+        patch_(flag_n),
+        patched_(0),
+        same_(NULL)
+    {
+        // a file too large to be mapped whole is just written out again
+        struct stat info;
+        if (_syscall(stat(path.c_str(), &info), ENOENT) != 0 || !S_ISREG(info.st_mode) || uint64_t(info.st_size) > Whole_)
+            Diverge();
+        else if (info.st_size != 0)
+            map_.open(path, O_RDONLY, PROT_READ, MAP_PRIVATE);
+
+#if defined(__APPLE__)
+        // the kernel caches the signature of a Mach-O against its vnode, so
+        // one changed where it is would be killed the next time it is run
+        if (map_.size() >= sizeof(uint32_t))
+            switch (*static_cast<const uint32_t *>(map_.data())) {
+                case MH_MAGIC: case MH_CIGAM:
+                case MH_MAGIC_64: case MH_CIGAM_64:
+                case FAT_MAGIC: case FAT_CIGAM:
+                case FAT_MAGIC_64: case FAT_CIGAM_64:
+                    patch_ = false;
+            }
+#endif
+    }
+
+    // source may be path itself, in which case what is written from it at
+    // the same offset is known to match without reading either of them
+    void source(const Map &source) {
+        file_.source(source);
+
+        struct stat mine, theirs;
+        if (!map_.empty() && !source.empty()) {
+            _syscall(fstat(map_.file(), &mine));
+            _syscall(fstat(source.file(), &theirs));
+            if (mine.st_dev == theirs.st_dev && mine.st_ino == theirs.st_ino)
+                same_ = &source;
+        }
+    }
+
+    virtual std::streamsize xsputn(const char_type *data, std::streamsize size) {
+        _assert(size >= 0);
+        if (temp_.empty()) {
+            if (Same(data, size)) {
+                offset_ += size;
+                return size;
+            }
+
+            if (size_t(size) <= map_.size() - offset_ && memcmp(static_cast<const char *>(map_.data()) + offset_, data, size) == 0) {
+                offset_ += size;
+                return size;
+            }
+
+            if (Patch(data, size))
+                return size;
+
+            Diverge();
+        }
+
+        return file_.sputn(data, size);
+    }
+
+    virtual int_type overflow(int_type next) {
+        if (next == traits_type::eof())
+            return traits_type::not_eof(next);
+        char value(next);
+        return xsputn(&value, 1) == 1 ? next : traits_type::eof();
+    }
+
+    virtual void sputv(const Range *ranges, size_t count) {
+        for (; temp_.empty() && count != 0; ++ranges, --count)
+            xsputn(static_cast<const char *>(ranges->data_), ranges->size_);
+        if (count != 0)
+            file_.sputv(ranges, count);
+    }
+
+    virtual void spad(size_t size) {
+        for (size_t writ; temp_.empty() && size != 0; size -= writ) {
+            writ = std::min(size, sizeof(padding_));
+            xsputn(padding_, writ);
+        }
+        if (size != 0)
+            file_.spad(size);
+    }
+
+    // returns the temporary to Commit, or an empty string if path was left as
+    // it is or patched in place; files that are hard linked elsewhere or not
+    // writable are always replaced
+    std::string Close() {
+        if (temp_.empty() && (!patches_.empty() || offset_ != map_.size())) {
+            struct stat info;
+            if (!patch_ || map_.empty() || _syscall(stat(path_.c_str(), &info)) != 0 || info.st_nlink != 1 || access(path_.c_str(), W_OK) != 0)
+                Diverge();
+            else
+                Apply();
+        }
+
+        map_.clear();
+        if (!temp_.empty())
+            file_.close();
+        return temp_;
+    }
+};
 #endif // LDID_NOTOOLS
 
 namespace ldid {
@@ -2435,9 +4399,199 @@ static void req(std::streambuf &buffer, uint8_t (&&data)[Size_]) {
     put(buffer, zeros, 3 - (Size_ + 3) % 4);
 }
 
-Hash Sign(const void *idata, size_t isize, std::streambuf &output, const std::string &identifier, const std::string &entitlements, bool merge, const std::string &requirements, const ldid::Signer &signer, const Slots &slots, uint32_t flags, uint8_t platform, const Progress &progress) {
+// padding and zerofill-adjacent data leave long runs of zero pages, whose
+// hash is known; most pages are not, so this gives up at the first nonzero
+// 64 bytes
+static bool Zero(const void *data, size_t size) {
+    typedef uint64_t Vector __attribute__((__vector_size__(16)));
+    auto bytes(static_cast<const uint8_t *>(data));
+
+    size_t i(0);
+    for (; i + 64 <= size; i += 64) {
+        Vector vectors[4];
+        memcpy(vectors, bytes + i, sizeof(vectors));
+        Vector value(vectors[0] | vectors[1] | vectors[2] | vectors[3]);
+        if ((value[0] | value[1]) != 0)
+            return false;
+    }
+
+    for (; i != size; ++i)
+        if (bytes[i] != 0)
+            return false;
+    return true;
+}
+
+// hashes code pages [begin, end) with the algorithms in the pending mask;
+// with -i, whole pages after the rewritten header that the old signature
+// covered are taken from it, but every flag_i'th one is hashed anyway and
+// the algorithms whose hashes differ from it are returned
+static uint32_t HashPages(const MachHeader &mach_header, Baton &baton, uint32_t pending, size_t limit, const std::string &overlap, size_t begin, size_t end, size_t &zeros) {
+    if (begin == end)
+        return 0;
+
+    const auto &algorithms(GetAlgorithms());
+    size_t normal((limit + flag_PageSize - 1) / flag_PageSize);
+    size_t first((overlap.size() + flag_PageSize - 1) / flag_PageSize);
+
+    // the pages are read as they will be written, the header rewritten
+    auto run(static_cast<const char *>(mach_header.GetPages(flag_PageSize * begin, std::min<size_t>(limit, flag_PageSize * end) - flag_PageSize * begin)));
+    const auto page([&](size_t index) {
+        return flag_PageSize * index < overlap.size() ? overlap.data() + flag_PageSize * index : run + flag_PageSize * (index - begin);
+    });
+
+    const auto covered([&](size_t index, size_t page) {
+        return page >= first && page < baton.reuse_[index];
+    });
+
+    const auto reused([&](size_t index, size_t page) {
+        return covered(index, page) && (page - first) % flag_i != 0;
+    });
+
+    std::atomic<uint32_t> stale(0);
+    std::atomic<size_t> zero(0);
+
+    // every algorithm hashes a page while it is still in cache
+    Parallel(end - begin, 0x100, fun([&](size_t from, size_t to, bool report) {
+        for (size_t i = begin + from; i != begin + to; ) {
+            // whole pages go to the algorithms in runs, which they may
+            // hash side by side; the last page can be short, so it is alone
+            const void *pages[16];
+            size_t count(0);
+            size_t size(flag_PageSize);
+            for (; count != 16 && i + count != begin + to && i + count != normal - 1; ++count)
+                pages[count] = page(i + count);
+            if (count == 0) {
+                pages[count++] = page(i);
+                size = ((limit - 1) % flag_PageSize) + 1;
+            }
+
+            // the short last page is hashed only once per slice anyway
+            bool zeros[16];
+            for (size_t page(0); page != count; ++page)
+                if ((zeros[page] = size == flag_PageSize && Zero(pages[page], size)))
+                    ++zero;
+
+            for (size_t index(0); index != algorithms.size(); ++index) {
+                if ((pending & 1 << index) == 0)
+                    continue;
+
+                Algorithm &algorithm(*algorithms[index]);
+                auto existing(baton.existing_[index]);
+                const void *data[16];
+                uint8_t *hashes[16];
+                size_t needed(0);
+                for (size_t page(0); page != count; ++page) {
+                    auto hash(&baton.hashes_[index][(i + page) * algorithm.size_]);
+                    if (reused(index, i + page))
+                        memcpy(hash, existing + (i + page) * algorithm.size_, algorithm.size_);
+                    else if (zeros[page])
+                        memcpy(hash, baton.zero_[index].data(), algorithm.size_);
+                    else {
+                        data[needed] = pages[page];
+                        hashes[needed++] = hash;
+                    }
+                }
+
+                algorithm(hashes, data, needed, size);
+
+                for (size_t page(0); page != count; ++page)
+                    if (covered(index, i + page) && !reused(index, i + page))
+                        if (memcmp(&baton.hashes_[index][(i + page) * algorithm.size_], existing + (i + page) * algorithm.size_, algorithm.size_) != 0)
+                            stale |= 1 << index;
+            }
+
+            i += count;
+        }
+    }));
+
+    zeros += zero;
+    return stale;
+}
+
+// a signature this signer made over the very same code directories is as
+// good as a new one, and keeping it leaves a re-signed file byte-identical
+static bool Existing(const MachHeader &mach_header, const Blobs &blobs, const ldid::Signer &signer, std::string &value) {
+    const struct Blob *wrapper(NULL);
+    size_t wrapped(0);
+    size_t directories(0);
+    bool same(true);
+
+    ForBlob(mach_header, fun([&](uint32_t type, const struct Blob *blob, size_t length) {
+        if (type == CSSLOT_SIGNATURESLOT) {
+            if (Swap(blob->magic) == CSMAGIC_BLOBWRAPPER) {
+                wrapper = blob;
+                wrapped = length;
+            }
+        } else if (type == CSSLOT_CODEDIRECTORY || type >= CSSLOT_ALTERNATE) {
+            ++directories;
+            auto found(blobs.find(type));
+            if (found == blobs.end() || found->second.size() != length || memcmp(found->second.data(), blob, length) != 0)
+                same = false;
+        }
+    }));
+
+    _foreach (blob, blobs)
+        if (blob.first == CSSLOT_CODEDIRECTORY || blob.first >= CSSLOT_ALTERNATE)
+            --directories;
+    if (!same || directories != 0 || wrapper == NULL)
+        return false;
+
+    auto data(reinterpret_cast<const unsigned char *>(wrapper + 1));
+    PKCS7 *pkcs7(d2i_PKCS7(NULL, &data, wrapped - sizeof(*wrapper)));
+    if (pkcs7 == NULL) {
+        ERR_clear_error();
+        return false;
+    }
+    _scope({ PKCS7_free(pkcs7); });
+
+    if (!PKCS7_type_is_signed(pkcs7))
+        return false;
+
+    // it has to carry exactly the certificates a new one would
+    STACK_OF(X509) *certs(signer);
+    STACK_OF(X509) *included(pkcs7->d.sign->cert);
+    if (included == NULL || sk_X509_num(included) != sk_X509_num(certs))
+        return false;
+    for (int i(0), e(sk_X509_num(certs)); i != e; ++i) {
+        bool found(false);
+        for (int j(0); j != e && !found; ++j)
+            found = X509_cmp(sk_X509_value(certs, i), sk_X509_value(included, j)) == 0;
+        if (!found)
+            return false;
+    }
+
+    auto signers(PKCS7_get0_signers(pkcs7, NULL, 0));
+    if (signers == NULL) {
+        ERR_clear_error();
+        return false;
+    }
+    _scope({ sk_X509_free(signers); });
+    if (sk_X509_num(signers) != 1 || X509_cmp(sk_X509_value(signers, 0), signer) != 0)
+        return false;
+
+    Buffer bio(blobs.find(CSSLOT_CODEDIRECTORY)->second);
+    if (PKCS7_verify(pkcs7, NULL, NULL, bio, NULL, PKCS7_NOVERIFY | PKCS7_BINARY) != 1) {
+        ERR_clear_error();
+        return false;
+    }
+
+    value.assign(reinterpret_cast<const char *>(wrapper + 1), wrapped - sizeof(*wrapper));
+    return true;
+}
+
+static Hash Sign(bool detached, FatHeader &source, std::streambuf &output, const std::string &identifier, const std::string &entitlements, bool merge, const std::string &requirements, const ldid::Signer &signer, const Slots &slots, uint32_t flags, uint8_t platform, const Progress &progress) {
     Hash hash;
 
+    // a detached signature holds the embedded signature of each slice,
+    // indexed by its cputype, and the image itself is not written at all
+    Blobs signatures;
+    NullBuffer null;
+
+    // slices can be saved at the same time, so the hash returned is kept as
+    // that of the last slice in the file, as when they are saved in order
+    std::mutex latest;
+    uint64_t last(0);
+
 
     std::string team;
     std::string common;
@@ -2486,20 +4640,19 @@ Hash Sign(const void *idata, size_t isize, std::streambuf &output, const std::st
     }
 
 
-    // XXX: this is just a "sufficiently large number"
-    size_t certificate(0x3000);
+    size_t certificate(0);
 
-    Allocate(idata, isize, output, fun([&](const MachHeader &mach_header, Baton &baton, size_t size) -> size_t {
+    Allocate(source, detached ? null : output, fun([&](const MachHeader &mach_header, Baton &baton, size_t size) -> size_t {
         size_t alloc(sizeof(struct SuperBlob));
 
-        uint32_t normal((size + PageSize_ - 1) / PageSize_);
+        uint32_t normal((size + flag_PageSize - 1) / flag_PageSize);
 
         uint32_t special(0);
 
         _foreach (slot, slots)
             special = std::max(special, slot.first);
 
-        mach_header.ForSection(fun([&](const char *segment, void *lc, const char *section, void *data, size_t size) {
+        mach_header.ForSection(fun([&](const char *segment, void *lc, const char *section, size_t offset, size_t size) {
             if (strcmp(segment, "__TEXT") == 0 && section != NULL && strcmp(section, "__info_plist") == 0)
                 special = std::max(special, CSSLOT_INFOSLOT);
         }));
@@ -2579,14 +4732,39 @@ Hash Sign(const void *idata, size_t isize, std::streambuf &output, const std::st
         for (Algorithm *algorithm : GetAlgorithms())
             alloc = Align(alloc + directory + (special + normal) * algorithm->size_, 16);
 
+        std::vector<uint8_t> zero(flag_PageSize);
+        for (Algorithm *algorithm : GetAlgorithms()) {
+            baton.hashes_.push_back(std::vector<uint8_t>(normal * algorithm->size_));
+            baton.zero_.push_back(std::vector<uint8_t>(algorithm->size_));
+            (*algorithm)(baton.zero_.back().data(), zero.data(), zero.size());
+
+            size_t count(0);
+            baton.existing_.push_back(flag_i == 0 ? NULL : Existing(mach_header, *algorithm, count));
+            baton.reuse_.push_back(std::min<size_t>(count, size / flag_PageSize));
+        }
+
         if (signer) {
+            certificate = std::max(certificate, Certificate(signer));
             alloc += sizeof(struct BlobIndex);
             alloc += sizeof(struct Blob);
-            alloc += certificate;
+            alloc += Certificate(signer);
         }
 
         return alloc;
-    }), fun([&](const MachHeader &mach_header, const Baton &baton, std::streambuf &output, size_t limit, size_t left, size_t right, const std::string &overlap, const char *top, const Progress &progress) -> size_t {
+    }), fun([&](const MachHeader &mach_header, Baton &baton, size_t limit, const std::string &overlap, size_t begin, size_t end) {
+        uint32_t stale(HashPages(mach_header, baton, (1 << GetAlgorithms().size()) - 1, limit, overlap, begin, end, baton.zeros_));
+        if (stale == 0)
+            return;
+
+        // the old signature is out of date, so those algorithms stop reusing
+        // it and hash every page again up to here
+        for (size_t index(0); index != GetAlgorithms().size(); ++index)
+            if ((stale & 1 << index) != 0)
+                baton.reuse_[index] = 0;
+        size_t zeros(0);
+        for (size_t page(0), step(Step(mach_header)); page < end; page += step)
+            HashPages(mach_header, baton, stale, limit, overlap, page, std::min(end, page + step), zeros);
+    }), fun([&](const MachHeader &mach_header, const Baton &baton, std::streambuf &output, size_t limit, size_t left, size_t right, const std::string &overlap, uint64_t offset, const Progress &progress) -> size_t {
         Blobs blobs;
 
         if (true) {
@@ -2598,9 +4776,7 @@ Hash Sign(const void *idata, size_t isize, std::streambuf &output, const std::st
             execs |= kSecCodeExecSegMainBinary;
 
         if (!baton.entitlements_.empty()) {
-            std::stringbuf data;
-            put(data, baton.entitlements_.data(), baton.entitlements_.size());
-            insert(blobs, CSSLOT_ENTITLEMENTS, CSMAGIC_EMBEDDED_ENTITLEMENTS, data);
+            insert(blobs, CSSLOT_ENTITLEMENTS, CSMAGIC_EMBEDDED_ENTITLEMENTS, baton.entitlements_.data(), baton.entitlements_.size());
 
             auto entitlements(plist(baton.entitlements_));
             _scope({ plist_free(entitlements); });
@@ -2634,34 +4810,37 @@ Hash Sign(const void *idata, size_t isize, std::streambuf &output, const std::st
                 execs |= kSecCodeExecSegCanExecCdHash;
         }
 
-        if (!baton.derformat_.empty()) {
-            std::stringbuf data;
-            put(data, baton.derformat_.data(), baton.derformat_.size());
-            insert(blobs, CSSLOT_DERFORMAT, CSMAGIC_EMBEDDED_DERFORMAT, data);
-        }
+        if (!baton.derformat_.empty())
+            insert(blobs, CSSLOT_DERFORMAT, CSMAGIC_EMBEDDED_DERFORMAT, baton.derformat_.data(), baton.derformat_.size());
 
         Slots posts(slots);
 
-        mach_header.ForSection(fun([&](const char *segment, void *lc, const char *section, void *data, size_t size) {
+        mach_header.ForSection(fun([&](const char *segment, void *lc, const char *section, size_t offset, size_t size) {
             if (strcmp(segment, "__TEXT") == 0 && section != NULL && strcmp(section, "__info_plist") == 0) {
                 auto &slot(posts[CSSLOT_INFOSLOT]);
+                auto data(mach_header.GetData(offset, size));
                 for (Algorithm *algorithm : GetAlgorithms())
                     (*algorithm)(slot, data, size);
             }
         }));
 
-        unsigned total(0);
-        for (Algorithm *pointer : GetAlgorithms()) {
-            Algorithm &algorithm(*pointer);
+        const auto &algorithms(GetAlgorithms());
 
-            std::stringbuf data;
+        uint32_t special(0);
+        _foreach (blob, blobs)
+            special = std::max(special, blob.first);
+        _foreach (slot, posts)
+            special = std::max(special, slot.first);
+        uint32_t normal((limit + flag_PageSize - 1) / flag_PageSize);
 
-            uint32_t special(0);
-            _foreach (blob, blobs)
-                special = std::max(special, blob.first);
-            _foreach (slot, posts)
-                special = std::max(special, slot.first);
-            uint32_t normal((limit + PageSize_ - 1) / PageSize_);
+        if (flag_v)
+            fprintf(stderr, "ldid: %s (%s): %zu of %u code pages were zero\n", identifier.c_str(), mach_header.GetCPUTypeString(), baton.zeros_, normal);
+
+        Hash cdhash;
+
+        unsigned total(0);
+        for (size_t index(0); index != algorithms.size(); ++index) {
+            Algorithm &algorithm(*algorithms[index]);
 
             CodeDirectory directory;
             directory.version = Swap(uint32_t(0x00020400));
@@ -2672,7 +4851,7 @@ Hash Sign(const void *idata, size_t isize, std::streambuf &output, const std::st
             directory.hashSize = algorithm.size_;
             directory.hashType = algorithm.type_;
             directory.platform = platform;
-            directory.pageSize = PageShift_;
+            directory.pageSize = flag_p;
             directory.spare2 = Swap(uint32_t(0));
             directory.scatterOffset = Swap(uint32_t(0));
             directory.spare3 = Swap(uint32_t(0));
@@ -2697,100 +4876,128 @@ Hash Sign(const void *idata, size_t isize, std::streambuf &output, const std::st
             directory.hashOffset = Swap(uint32_t(offset));
             offset += normal * algorithm.size_;
 
-            put(data, &directory, sizeof(directory));
+            // the directory is written straight into its blob, hash slots
+            // and all, as the page hashes are the bulk of the signature
+            auto &save(insert(blobs, total == 0 ? CSSLOT_CODEDIRECTORY : CSSLOT_ALTERNATE + total - 1, CSMAGIC_CODEDIRECTORY, offset - sizeof(Blob)));
+            auto data(&save[0]);
 
-            put(data, identifier.c_str(), identifier.size() + 1);
+            memcpy(data + sizeof(Blob), &directory, sizeof(directory));
+            memcpy(data + Swap(directory.identOffset), identifier.c_str(), identifier.size() + 1);
             if (!team.empty())
-                put(data, team.c_str(), team.size() + 1);
-
-            std::vector<uint8_t> storage((special + normal) * algorithm.size_);
-            auto *hashes(&storage[special * algorithm.size_]);
+                memcpy(data + Swap(directory.teamIDOffset), team.c_str(), team.size() + 1);
 
-            memset(storage.data(), 0, special * algorithm.size_);
+            auto hashes(reinterpret_cast<uint8_t *>(data + Swap(directory.hashOffset)));
 
-            _foreach (blob, blobs) {
-                auto local(reinterpret_cast<const Blob *>(&blob.second[0]));
-                algorithm(hashes - blob.first * algorithm.size_, local, Swap(local->length));
-            }
+            // the code directories already saved are not special slots
+            _foreach (blob, blobs)
+                if (blob.first != CSSLOT_CODEDIRECTORY && blob.first <= special) {
+                    auto local(reinterpret_cast<const Blob *>(&blob.second[0]));
+                    algorithm(hashes - blob.first * algorithm.size_, local, Swap(local->length));
+                }
 
             _foreach (slot, posts)
                 memcpy(hashes - slot.first * algorithm.size_, algorithm[slot.second], algorithm.size_);
 
-            progress(0);
-            if (normal != 1)
-                for (size_t i = 0; i != normal - 1; ++i) {
-                    algorithm(hashes + i * algorithm.size_, (PageSize_ * i < overlap.size() ? overlap.data() : top) + PageSize_ * i, PageSize_);
-                    progress(double(i) / normal);
-                }
-            if (normal != 0)
-                algorithm(hashes + (normal - 1) * algorithm.size_, top + PageSize_ * (normal - 1), ((limit - 1) % PageSize_) + 1);
-            progress(1);
-
-            put(data, storage.data(), storage.size());
+            const auto &pages(baton.hashes_[index]);
+            _assert(pages.size() == normal * algorithm.size_);
+            memcpy(hashes, pages.data(), pages.size());
 
-            const auto &save(insert(blobs, total == 0 ? CSSLOT_CODEDIRECTORY : CSSLOT_ALTERNATE + total - 1, CSMAGIC_CODEDIRECTORY, data));
-            algorithm(hash, save.data(), save.size());
+            algorithm(cdhash, save.data(), save.size());
 
             ++total;
         }
 
+        {
+            std::lock_guard<std::mutex> lock(latest);
+            if (last <= offset) {
+                last = offset;
+                hash = cdhash;
+            }
+        }
+
         if (signer) {
-            auto plist(plist_new_dict());
-            _scope({ plist_free(plist); });
+            // an old CMS is only kept if it fits in what was set aside
+            std::string value;
+            if (!Existing(mach_header, blobs, signer, value) || value.size() > certificate) {
+                auto plist(plist_new_dict());
+                _scope({ plist_free(plist); });
 
-            auto cdhashes(plist_new_array());
-            plist_dict_set_item(plist, "cdhashes", cdhashes);
+                auto cdhashes(plist_new_array());
+                plist_dict_set_item(plist, "cdhashes", cdhashes);
 
-            ldid::Hash hash;
+                ldid::Hash hash;
 
-            unsigned total(0);
-            for (Algorithm *pointer : GetAlgorithms()) {
-                Algorithm &algorithm(*pointer);
-                (void) algorithm;
+                unsigned total(0);
+                for (Algorithm *pointer : GetAlgorithms()) {
+                    Algorithm &algorithm(*pointer);
+                    (void) algorithm;
 
-                const auto &blob(blobs[total == 0 ? CSSLOT_CODEDIRECTORY : CSSLOT_ALTERNATE + total - 1]);
-                ++total;
+                    const auto &blob(blobs[total == 0 ? CSSLOT_CODEDIRECTORY : CSSLOT_ALTERNATE + total - 1]);
+                    ++total;
 
-                algorithm(hash, blob.data(), blob.size());
+                    algorithm(hash, blob.data(), blob.size());
 
-                std::vector<char> cdhash(algorithm[hash], algorithm[hash] + algorithm.size_);
-                cdhash.resize(20);
+                    std::vector<char> cdhash(algorithm[hash], algorithm[hash] + algorithm.size_);
+                    cdhash.resize(20);
 
-                plist_array_append_item(cdhashes, plist_new_data(cdhash.data(), cdhash.size()));
-            }
+                    plist_array_append_item(cdhashes, plist_new_data(cdhash.data(), cdhash.size()));
+                }
 
-            char *xml(NULL);
-            uint32_t size;
-            plist_to_xml(plist, &xml, &size);
-            _scope({ free(xml); });
+                char *xml(NULL);
+                uint32_t size;
+                plist_to_xml(plist, &xml, &size);
+                _scope({ free(xml); });
 
-            std::stringbuf data;
-            const std::string &sign(blobs[CSSLOT_CODEDIRECTORY]);
+                const std::string &sign(blobs[CSSLOT_CODEDIRECTORY]);
 
-            Buffer bio(sign);
+                Buffer bio(sign);
+
+                Signature signature(signer, sign, std::string(xml, size), hash);
+                Buffer result(signature);
+                value = std::string(result);
+            }
+
+            const auto &save(insert(blobs, CSSLOT_SIGNATURESLOT, CSMAGIC_BLOBWRAPPER, value.data(), value.size()));
+            _assert(save.size() <= sizeof(struct Blob) + certificate);
+        }
 
-            Signature signature(signer, sign, std::string(xml, size), hash);
-            Buffer result(signature);
-            std::string value(result);
-            put(data, value.data(), value.size());
+        if (detached) {
+            std::stringbuf data;
+            put(data, CSMAGIC_EMBEDDED_SIGNATURE, blobs);
 
-            const auto &save(insert(blobs, CSSLOT_SIGNATURESLOT, CSMAGIC_BLOBWRAPPER, data));
-            _assert(save.size() <= certificate);
+            std::lock_guard<std::mutex> lock(latest);
+            _assert_(signatures.find(mach_header.GetCPUType()) == signatures.end(), "cannot detach the signatures of two slices with the same cputype");
+            insert(signatures, mach_header.GetCPUType(), data);
+            return 0;
         }
 
         return put(output, CSMAGIC_EMBEDDED_SIGNATURE, blobs);
-    }), progress);
+    }), progress, detached);
+
+    if (detached)
+        put(output, CSMAGIC_DETACHED_SIGNATURE, signatures);
 
     return hash;
 }
 
+Hash Sign(const void *idata, size_t isize, std::streambuf &output, const std::string &identifier, const std::string &entitlements, bool merge, const std::string &requirements, const ldid::Signer &signer, const Slots &slots, uint32_t flags, uint8_t platform, const Progress &progress) {
+    FatHeader source(const_cast<void *>(idata), isize);
+    return Sign(false, source, output, identifier, entitlements, merge, requirements, signer, slots, flags, platform, progress);
+}
+
+Hash Detach(const void *idata, size_t isize, std::streambuf &output, const std::string &identifier, const std::string &entitlements, bool merge, const std::string &requirements, const ldid::Signer &signer, const Slots &slots, uint32_t flags, uint8_t platform, const Progress &progress) {
+    FatHeader source(const_cast<void *>(idata), isize);
+    return Sign(true, source, output, identifier, entitlements, merge, requirements, signer, slots, flags, platform, progress);
+}
+
 #ifndef LDID_NOTOOLS
-static void Unsign(void *idata, size_t isize, std::streambuf &output, const Progress &progress) {
-    Allocate(idata, isize, output, fun([](const MachHeader &mach_header, Baton &baton, size_t size) -> size_t {
+static void Unsign(FatHeader &source, std::streambuf &output, const Progress &progress) {
+    Allocate(source, output, fun([](const MachHeader &mach_header, Baton &baton, size_t size) -> size_t {
         return 0;
-    }), fun([](const MachHeader &mach_header, const Baton &baton, std::streambuf &output, size_t limit, size_t left, size_t right, const std::string &overlap, const char *top, const Progress &progress) -> size_t {
+    }), fun([](const MachHeader &mach_header, Baton &baton, size_t limit, const std::string &overlap, size_t begin, size_t end) {
+    }), fun([](const MachHeader &mach_header, const Baton &baton, std::streambuf &output, size_t limit, size_t left, size_t right, const std::string &overlap, uint64_t offset, const Progress &progress) -> size_t {
         return 0;
-    }), progress);
+    }), progress, false);
 }
 
 std::string DiskFolder::Path(const std::string &path) const {
@@ -2878,10 +5085,14 @@ void DiskFolder::Save(const std::string &path, bool edit, const void *flag, cons
         NullBuffer save;
         code(save);
     } else {
-        std::filebuf save;
         auto from(Path(path));
-        commit_[from] = Temporary(save, from);
+        CompareBuffer save(from);
         code(save);
+        auto temp(save.Close());
+        if (!temp.empty()) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            commit_[from] = temp;
+        }
     }
 }
 
@@ -2889,12 +5100,22 @@ bool DiskFolder::Look(const std::string &path) const {
     return _syscall(access(Path(path).c_str(), R_OK), ENOENT) == 0;
 }
 
+// files smaller than this are just read, as mapping them costs more
+static const size_t Mapped_(0x100000);
+
 void DiskFolder::Open(const std::string &path, const Functor<void (std::streambuf &, size_t, const void *)> &code) const {
     std::filebuf data;
     auto result(data.open(Path(path).c_str(), std::ios::binary | std::ios::in));
     _assert_(result == &data, "DiskFolder::Open(%s)", Path(path).c_str());
-
     auto length(data.pubseekoff(0, std::ios::end, std::ios::in));
+
+    if (size_t(length) >= Mapped_) {
+        data.close();
+        MapBuffer mapped(Path(path));
+        code(mapped, mapped.image().size(), NULL);
+        return;
+    }
+
     data.pubseekpos(0, std::ios::in);
     code(data, length, NULL);
 }
@@ -3137,6 +5358,18 @@ struct RuleCode {
 };
 
 static Hash Sign(const uint8_t *prefix, size_t size, std::streambuf &buffer, Hash &hash, std::streambuf &save, const std::string &identifier, const std::string &entitlements, bool merge, const std::string &requirements, const ldid::Signer &signer, const Slots &slots, size_t length, uint32_t flags, uint8_t platform, const Progress &progress) {
+    // a file from disk is signed where it is mapped, or through a window onto
+    // it, which its zeros after it pad as below, so only the pages being
+    // worked on need to be in memory
+    if (auto mapped = dynamic_cast<MapBuffer *>(&buffer))
+        if (mapped->image().size() == length) {
+            HashProxy proxy(hash, save);
+            auto source(mapped->image().Header(length + 0x10 - (length & 0xf)));
+            auto result(Sign(false, source, proxy, identifier, entitlements, merge, requirements, signer, slots, flags, platform, progress));
+            _assert(proxy.pubsync() == 0);
+            return result;
+        }
+
     // XXX: this is a miserable fail
     std::stringbuf temp;
     put(temp, prefix, size);
@@ -3146,7 +5379,9 @@ static Hash Sign(const uint8_t *prefix, size_t size, std::streambuf &buffer, Has
     auto data(temp.str());
 
     HashProxy proxy(hash, save);
-    return Sign(data.data(), data.size(), proxy, identifier, entitlements, merge, requirements, signer, slots, flags, platform, progress);
+    auto result(Sign(data.data(), data.size(), proxy, identifier, entitlements, merge, requirements, signer, slots, flags, platform, progress));
+    _assert(proxy.pubsync() == 0);
+    return result;
 }
 
 struct State {
@@ -3208,6 +5443,13 @@ Bundle Sign(const std::string &root, Folder &parent, const ldid::Signer &signer,
 
     std::string entitlements;
     folder.Open(executable, fun([&](std::streambuf &buffer, size_t length, const void *flag) {
+        if (auto mapped = dynamic_cast<MapBuffer *>(&buffer))
+            if (mapped->image().size() == length) {
+                auto source(mapped->image().Header(length + 0x10 - (length & 0xf)));
+                entitlements = alter(root, Analyze(source));
+                return;
+            }
+
         // XXX: this is a miserable fail
         std::stringbuf temp;
         copy(buffer, temp, length, progress);
@@ -3256,7 +5498,24 @@ Bundle Sign(const std::string &root, Folder &parent, const ldid::Signer &signer,
     Expression nested("^(Frameworks/[^/]*\\.framework|PlugIns/[^/]*\\.appex(()|/[^/]*.app))/(" + failure + ")Info\\.plist$");
     std::map<std::string, Bundle> bundles;
 
+    Serialized serialized(progress);
+    std::atomic<size_t> next(0);
+
     if (!flag_w) {
+        // each nested bundle only needs its own folder, so they are found in
+        // order and then signed at the same time, along with any bundles of
+        // their own; this one then takes their hashes and files once all of
+        // them are done
+        struct Nested {
+            std::string name_;
+            std::string key_;
+            std::string bundle_;
+            State remote_;
+            Bundle signed_;
+        };
+
+        std::vector<Nested> children;
+
         folder.Find("", fun([&](const std::string &name) {
             if (!nested(name))
                 return;
@@ -3265,15 +5524,40 @@ Bundle Sign(const std::string &root, Folder &parent, const ldid::Signer &signer,
                 _assert(!bundle.empty());
                 bundle = Split(bundle.substr(0, bundle.size() - 1)).dir;
             }
-            SubFolder subfolder(folder, bundle);
 
-            State remote;
-            bundles[nested[1]] = Sign(root + bundle, subfolder, signer, remote, requirements, Starts(name, "PlugIns/") ? alter :
-                static_cast<const Functor<std::string (const std::string &, const std::string &)> &>(fun([&](const std::string &, const std::string &) -> std::string { return entitlements; }))
-            , merge, platform, progress);
-            local.Merge(bundle, remote);
+            children.push_back(Nested());
+            auto &child(children.back());
+            child.name_ = name;
+            child.key_ = nested[1];
+            child.bundle_ = bundle;
         }), fun([&](const std::string &name, const Functor<std::string ()> &read) {
         }));
+
+        const auto child([&](size_t index) {
+            auto &child(children[index]);
+            SubFolder subfolder(folder, child.bundle_);
+            child.signed_ = Sign(root + child.bundle_, subfolder, signer, child.remote_, requirements, Starts(child.name_, "PlugIns/") ? alter :
+                static_cast<const Functor<std::string (const std::string &, const std::string &)> &>(fun([&](const std::string &, const std::string &) -> std::string { return entitlements; }))
+            , merge, platform, serialized);
+        });
+
+        // as with the files below, they are signed one at a time until the
+        // hashes to use are settled, which a bundle without a Mach-O in it
+        // leaves as they were
+        size_t first(0);
+        while (first != children.size() && !Settled())
+            child(first++);
+
+        next = first;
+        Parallel(children.size() - first, 1, fun([&](size_t, size_t, bool) {
+            for (size_t index; (index = next++) < children.size(); )
+                child(index);
+        }));
+
+        for (const auto &child : children) {
+            bundles[child.key_] = child.signed_;
+            local.Merge(child.bundle_, child.remote_);
+        }
     }
 
     std::set<std::string> excludes;
@@ -3292,16 +5576,39 @@ Bundle Sign(const std::string &root, Folder &parent, const ldid::Signer &signer,
         return false;
     });
 
+    // the files are found in order, and each is given its entry here, so
+    // that they can then be hashed by several workers at once without the
+    // result depending on which got to a file first
+    std::vector<std::pair<std::string, Hash *>> entries;
+
     folder.Find("", fun([&](const std::string &name) {
         if (exclude(name))
             return;
 
         if (local.files.find(name) != local.files.end())
             return;
-        auto &hash(local.files[name]);
+        entries.push_back(std::make_pair(name, &local.files[name]));
+    }), fun([&](const std::string &name, const Functor<std::string ()> &read) {
+        if (exclude(name))
+            return;
+
+        local.links[name] = read();
+    }));
+
+    next = 0;
+
+    // which hashes are used is only settled by the first Mach-O signed, so
+    // until then any found are put off, and the first of them signed alone
+    bool settled(Settled());
+    std::mutex mutex;
+    std::vector<size_t> deferred;
+
+    const auto resource([&](size_t index) {
+        const auto &name(entries[index].first);
+        auto &hash(*entries[index].second);
 
         folder.Open(name, fun([&](std::streambuf &data, size_t length, const void *flag) {
-            progress(root + name);
+            serialized(root + name);
 
             union {
                 struct {
@@ -3330,9 +5637,16 @@ Bundle Sign(const std::string &root, Folder &parent, const ldid::Signer &signer,
                                     break;
                             }
                         case FAT_CIGAM:
+                        case FAT_MAGIC_64: case FAT_CIGAM_64:
+                            if (!settled) {
+                                std::lock_guard<std::mutex> lock(mutex);
+                                deferred.push_back(index);
+                                return;
+                            }
+
                             folder.Save(name, true, flag, fun([&](std::streambuf &save) {
                                 Slots slots;
-                                Sign(header.bytes, size, data, hash, save, identifier, entitlements, merge, requirements, signer, slots, length, 0, platform, Progression(progress, root + name));
+                                Sign(header.bytes, size, data, hash, save, identifier, entitlements, merge, requirements, signer, slots, length, 0, platform, Progression(serialized, root + name));
                             }));
                             return;
                     }
@@ -3341,16 +5655,31 @@ Bundle Sign(const std::string &root, Folder &parent, const ldid::Signer &signer,
             folder.Save(name, false, flag, fun([&](std::streambuf &save) {
                 HashProxy proxy(hash, save);
                 put(proxy, header.bytes, size);
-                copy(data, proxy, length - size, progress);
+                copy(data, proxy, length - size, serialized);
+                _assert(proxy.pubsync() == 0);
             }));
         }));
-    }), fun([&](const std::string &name, const Functor<std::string ()> &read) {
-        if (exclude(name))
-            return;
+    });
 
-        local.links[name] = read();
+    // files differ too much in size to be split up evenly ahead of time,
+    // so each worker just takes the next one until none are left
+    Parallel(entries.size(), 1, fun([&](size_t, size_t, bool) {
+        for (size_t index; (index = next++) < entries.size(); )
+            resource(index);
     }));
 
+    if (!deferred.empty()) {
+        std::sort(deferred.begin(), deferred.end());
+        settled = true;
+        resource(deferred[0]);
+
+        next = 1;
+        Parallel(deferred.size() - 1, 1, fun([&](size_t, size_t, bool) {
+            for (size_t index; (index = next++) < deferred.size(); )
+                resource(deferred[index]);
+        }));
+    }
+
     auto plist(plist_new_dict());
     _scope({ plist_free(plist); });
 
@@ -3452,6 +5781,7 @@ Bundle Sign(const std::string &root, Folder &parent, const ldid::Signer &signer,
         plist_to_xml(plist, &xml, &size);
         _scope({ free(xml); });
         put(proxy, xml, size);
+        _assert(proxy.pubsync() == 0);
     }));
 
     Bundle bundle;
@@ -3492,9 +5822,10 @@ static void usage(const char *argv0) {
     fprintf(stderr, "Link Identity Editor %s\n\n", LDID_VERSION);
     fprintf(stderr, "Usage: %s [-Acputype:subtype] [-a] [-C[adhoc | enforcement | expires | hard |\n", argv0);
     fprintf(stderr, "            host | kill | library-validation | restrict | runtime | linker-signed]] [-D] [-d]\n");
-    fprintf(stderr, "            [-Enum:file] [-e] [-H[sha1 | sha256]] [-h] [-Iname]\n");
-    fprintf(stderr, "            [-Kkey.p12 [-Upassword]] [-M] [-P[num]] [-Qrequirements.xml] [-q]\n");
-    fprintf(stderr, "            [-r | -Sfile.xml | -s] [-w] [-u] [-tTeamID] [-arch arch_type] file ...\n");
+    fprintf(stderr, "            [-Enum:file] [-e] [-H[sha1 | sha256]] [-h] [-Iname] [-i[num]]\n");
+    fprintf(stderr, "            [-j[num]] [-Kkey.p12 [-Upassword]] [-M] [-n] [-Ofile] [-ofile]\n");
+    fprintf(stderr, "            [-P[num]] [-pshift] [-Qrequirements.xml] [-q] [-r | -Sfile.xml | -s]\n");
+    fprintf(stderr, "            [-w] [-u] [-tTeamID] [-v] [-arch arch_type] file ...\n");
     fprintf(stderr, "Common Options:\n");
     fprintf(stderr, "   -S[file.xml]  Pseudo-sign using the entitlements in file.xml\n");
     fprintf(stderr, "   -w            Shallow sign\n");
@@ -3511,6 +5842,29 @@ void cleanupfunc(void) {
 }
 
 #ifndef LDID_NOTOOLS
+// -s keeps the identifier of the existing signature
+static void Identify(FatHeader &fat_header, std::string &identifier) {
+    _foreach (mach_header, fat_header.GetMachHeaders()) {
+        struct linkedit_data_command *signature(NULL);
+
+        _foreach (load_command, mach_header.GetLoadCommands())
+            if (mach_header.Swap(load_command->cmd) == LC_CODE_SIGNATURE)
+                signature = reinterpret_cast<struct linkedit_data_command *>(load_command);
+
+        uint32_t data = mach_header.Swap(signature->dataoff);
+
+        auto blob(static_cast<const uint8_t *>(mach_header.GetData(data, mach_header.Swap(signature->datasize))));
+        auto super(reinterpret_cast<const struct SuperBlob *>(blob));
+
+        for (size_t index(0); index != Swap(super->count); ++index)
+            if (Swap(super->index[index].type) == CSSLOT_CODEDIRECTORY) {
+                uint32_t begin = Swap(super->index[index].offset);
+                auto directory(reinterpret_cast<const struct CodeDirectory *>(blob + begin + sizeof(Blob)));
+                identifier = (const char *)(blob + begin + Swap(directory->identOffset));
+            }
+    }
+}
+
 int main(int argc, char *argv[]) {
     std::atexit(cleanupfunc);
     OpenSSL_add_all_algorithms();
@@ -3543,7 +5897,6 @@ int main(int argc, char *argv[]) {
     bool flag_D(false);
     bool flag_d(false);
 
-    bool flag_A(false);
     bool flag_a(false);
 
     bool flag_u(false);
@@ -3553,10 +5906,9 @@ int main(int argc, char *argv[]) {
     uint32_t flags(0);
     uint8_t platform(0);
 
-    uint32_t flag_CPUType(_not(uint32_t));
-    uint32_t flag_CPUSubtype(_not(uint32_t));
-
     const char *flag_I(NULL);
+    const char *flag_O(NULL);
+    const char *flag_o(NULL);
 
 
     Map entitlements;
@@ -3586,8 +5938,7 @@ int main(int argc, char *argv[]) {
             }
             for (int i = 0; archs[i].name != NULL; i++) {
                 if (strcmp(archs[i].name, argv[argi]) == 0) {
-                    flag_CPUType = archs[i].cputype;
-                    flag_CPUSubtype = archs[i].cpusubtype;
+                    flag_CPUTypes.insert(std::make_pair(archs[i].cputype, archs[i].cpusubtype));
                     foundarch = true;
                 }
                 if (foundarch)
@@ -3629,6 +5980,45 @@ int main(int argc, char *argv[]) {
             } break;
 
             case 'q': flag_q = true; break;
+            case 'v': flag_v = true; break;
+            case 'n': flag_n = true; break;
+
+            case 'j':
+                if (argv[argi][2] != '\0') {
+                    char *arge;
+                    flag_j = strtoul(argv[argi] + 2, &arge, 0);
+                    if (*arge != '\0') {
+                        usage(argv[0]);
+                        exit(1);
+                    }
+                } else {
+                    flag_j = 0;
+                }
+            break;
+
+            case 'i':
+                if (argv[argi][2] != '\0') {
+                    char *arge;
+                    flag_i = strtoul(argv[argi] + 2, &arge, 0);
+                    if (*arge != '\0' || flag_i == 0) {
+                        usage(argv[0]);
+                        exit(1);
+                    }
+                } else {
+                    flag_i = 32;
+                }
+            break;
+
+            case 'p': {
+                char *arge;
+                auto shift(strtoul(argv[argi] + 2, &arge, 0));
+                if (argv[argi][2] == '\0' || *arge != '\0' || shift < 12 || shift > 16) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                flag_p = shift;
+                flag_PageSize = 1 << flag_p;
+            } break;
 
             case 'H': {
                 const char *hash = argv[argi] + 2;
@@ -3663,10 +6053,6 @@ int main(int argc, char *argv[]) {
             case 'a': flag_a = true; break;
 
             case 'A':
-                if (flag_A) {
-                    fprintf(stderr, "ldid: -A can only be specified once\n");
-                    exit(1);
-                }
                 flag_A = true;
                 if (argv[argi][2] != '\0') {
                     const char *cpu = argv[argi] + 2;
@@ -3676,16 +6062,17 @@ int main(int argc, char *argv[]) {
                         exit(1);
                     }
                     char *arge;
-                    flag_CPUType = strtoul(cpu, &arge, 0);
-                    if (arge != colon || (flag_CPUType == 0 && errno == EINVAL)) {
+                    uint32_t cputype = strtoul(cpu, &arge, 0);
+                    if (arge != colon || (cputype == 0 && errno == EINVAL)) {
                         usage(argv[0]);
                         exit(1);
                     }
-                    flag_CPUSubtype = strtoul(colon + 1, &arge, 0);
-                    if (arge != argv[argi] + strlen(argv[argi]) || (flag_CPUSubtype == 0 && errno == EINVAL)) {
+                    uint32_t cpusubtype = strtoul(colon + 1, &arge, 0);
+                    if (arge != argv[argi] + strlen(argv[argi]) || (cpusubtype == 0 && errno == EINVAL)) {
                         usage(argv[0]);
                         exit(1);
                     }
+                    flag_CPUTypes.insert(std::make_pair(cputype, cpusubtype));
                 }
             break;
 
@@ -3790,6 +6177,22 @@ int main(int argc, char *argv[]) {
                 flag_I = argv[argi] + 2;
             } break;
 
+            case 'O':
+                if (argv[argi][2] == '\0') {
+                    fprintf(stderr, "ldid: -O requires a file\n");
+                    exit(1);
+                }
+                flag_O = argv[argi] + 2;
+            break;
+
+            case 'o':
+                if (argv[argi][2] == '\0') {
+                    fprintf(stderr, "ldid: -o requires a file\n");
+                    exit(1);
+                }
+                flag_o = argv[argi] + 2;
+            break;
+
             default:
                 usage(argv[0]);
                 return 1;
@@ -3801,6 +6204,26 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    if (flag_O != NULL && !flag_S) {
+        fprintf(stderr, "ldid: -O requires -S\n");
+        exit(1);
+    }
+
+    if (flag_O != NULL && files.size() > 1) {
+        fprintf(stderr, "ldid: -O can only be used with one file\n");
+        exit(1);
+    }
+
+    if (flag_o != NULL && !flag_S && !flag_r && !flag_s) {
+        fprintf(stderr, "ldid: -o requires -r, -S or -s\n");
+        exit(1);
+    }
+
+    if (flag_o != NULL && flag_O != NULL) {
+        fprintf(stderr, "ldid: Can only specify one of -O, -o\n");
+        exit(1);
+    }
+
     if (files.empty())
         return 0;
 
@@ -3817,6 +6240,64 @@ int main(int argc, char *argv[]) {
             signer = new P12Signer(Buffer(Map(key, O_RDONLY, PROT_READ, MAP_PRIVATE)), certs);
     }
 
+    // with -o, the chosen slices of every file are signed and written out
+    // together in one pass, as a universal binary if there are several, and
+    // the rest then only looks at what was written
+    if (flag_o != NULL) {
+        std::list<Image> inputs;
+        std::vector<FatMachHeader> slices;
+
+        _foreach (file, files) {
+            struct stat info;
+            if (stat(file.c_str(), &info) == -1) {
+                fprintf(stderr, "ldid: %s: %s\n", file.c_str(), strerror(errno));
+                exit(1);
+            }
+
+            if (S_ISDIR(info.st_mode)) {
+                fprintf(stderr, "ldid: -o cannot be used on directories\n");
+                exit(1);
+            }
+
+            inputs.emplace_back(file);
+            auto fat_header(inputs.back().Header(inputs.back().size()));
+            _foreach (mach_header, fat_header.GetMachHeaders())
+                if (Chosen(mach_header))
+                    slices.push_back(mach_header);
+        }
+
+        if (slices.empty()) {
+            fprintf(stderr, "ldid: -o has no slices to write\n");
+            exit(1);
+        }
+
+        FatHeader source(slices);
+        CompareBuffer output(flag_o);
+        _foreach (input, inputs)
+            output.source(input.map());
+
+        if (flag_r)
+            ldid::Unsign(source, output, dummy_);
+        else {
+            std::string identifier(flag_I ?: Split(flag_o).base.c_str());
+            if (flag_s)
+                Identify(source, identifier);
+            ldid::Sign(false, source, output, identifier, entitlements, flag_M, requirements, *signer, slots, flags, platform, dummy_);
+        }
+
+        // the inputs are unmapped before output is closed, but stay in the
+        // list so that output's pointers to them (sources_, same_) do not dangle
+        for (auto &input : inputs)
+            input.clear();
+
+        auto temp(output.Close());
+        if (!temp.empty())
+            Commit(flag_o, temp);
+
+        files.assign(1, flag_o);
+        flag_r = flag_S = flag_s = false;
+    }
+
     size_t filei(0), filee(0);
     _foreach (file, files) try {
         std::string path(file);
@@ -3832,49 +6313,42 @@ int main(int argc, char *argv[]) {
                 fprintf(stderr, "ldid: Only -S and -s can be used on directories\n");
                 exit(1);
             }
+            if (flag_O != NULL) {
+                fprintf(stderr, "ldid: -O cannot be used on directories\n");
+                exit(1);
+            }
+            if (flag_A) {
+                fprintf(stderr, "ldid: -A and -arch cannot be used on directories\n");
+                exit(1);
+            }
             ldid::DiskFolder folder(path + "/");
             path += "/" + Sign("", folder, *signer, requirements, ldid::fun([&](const std::string &, const std::string &) -> std::string { return entitlements; }), flag_M, platform, dummy_).path;
         } else if (flag_S || flag_r || flag_s) {
-            Map input(path, O_RDONLY, PROT_READ, MAP_PRIVATE);
-
-            std::filebuf output;
+            Image input(path);
+
+            // a detached signature is written to its own file, and the binary
+            // is only read
+            std::string target(flag_O ?: path);
+            CompareBuffer output(target);
+            if (flag_O == NULL)
+                output.source(input.map());
             Split split(path);
-            auto temp(Temporary(output, split));
 
+            auto fat_header(input.Header(input.size()));
             if (flag_r)
-                ldid::Unsign(input.data(), input.size(), output, dummy_);
+                ldid::Unsign(fat_header, output, dummy_);
             else {
                 std::string identifier(flag_I ?: split.base.c_str());
-                if (flag_s) {
-                    FatHeader fat_header(input.data(), input.size());
-                    _foreach (mach_header, fat_header.GetMachHeaders()) {
-                        struct linkedit_data_command *signature(NULL);
-
-                        _foreach (load_command, mach_header.GetLoadCommands())
-                            if (mach_header.Swap(load_command->cmd) == LC_CODE_SIGNATURE)
-                                signature = reinterpret_cast<struct linkedit_data_command *>(load_command);
-
-                        uint32_t data = mach_header.Swap(signature->dataoff);
-
-                        uint8_t *top = reinterpret_cast<uint8_t *>(mach_header.GetBase());
-                        uint8_t *blob = top + data;
-                        struct SuperBlob *super = reinterpret_cast<struct SuperBlob *>(blob);
-
-                        for (size_t index(0); index != Swap(super->count); ++index)
-                            if (Swap(super->index[index].type) == CSSLOT_CODEDIRECTORY) {
-                                uint32_t begin = Swap(super->index[index].offset);
-                                struct CodeDirectory *directory = reinterpret_cast<struct CodeDirectory *>(blob + begin + sizeof(Blob));
-                                identifier = (const char *)(blob + begin + Swap(directory->identOffset));
-                            }
-                    }
-                }
-                ldid::Sign(input.data(), input.size(), output, identifier, entitlements, flag_M, requirements, *signer, slots, flags, platform, dummy_);
+                if (flag_s)
+                    Identify(fat_header, identifier);
+                ldid::Sign(flag_O != NULL, fat_header, output, identifier, entitlements, flag_M, requirements, *signer, slots, flags, platform, dummy_);
             }
 
             input.clear();
-            output.close();
 
-            Commit(path, temp);
+            auto temp(output.Close());
+            if (!temp.empty())
+                Commit(target, temp);
         }
 
         Map mapping(path, flag_D ? true : false);
@@ -3884,12 +6358,8 @@ int main(int argc, char *argv[]) {
             struct linkedit_data_command *signature(NULL);
             struct encryption_info_command *encryption(NULL);
 
-            if (flag_A) {
-                if (mach_header.GetCPUType() != flag_CPUType)
-                    continue;
-                if (mach_header.GetCPUSubtype() != flag_CPUSubtype)
-                    continue;
-            }
+            if (!Chosen(mach_header))
+                continue;
 
             if (flag_a)
                 printf("cpu=0x%x:0x%x\n", mach_header.GetCPUType(), mach_header.GetCPUSubtype());
@@ -4056,6 +6526,13 @@ int main(int argc, char *argv[]) {
                 }
                 printf("Hash choices=%s\n", choices.c_str() + 1);
 
+                if (directory->pageSize == 0)
+                    printf("Page size=none\n");
+                else if (directory->pageSize < 32)
+                    printf("Page size=%u\n", 1u << directory->pageSize);
+                else
+                    printf("Page size=2^%u\n", directory->pageSize);
+
                 printf("CDHash=%.40s\n", best->second.hash_.c_str());
 
                 if (cmsBegin != 0 && cmsEnd != 0) {
@@ -5,6 +5,7 @@
 
 #include <cstdlib>
 #include <map>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <streambuf>
@@ -57,6 +58,8 @@ struct Progress {
     virtual void operator()(double value) const = 0;
 };
 
+// bundle Sign calls these from several threads at once, so any folder handed
+// to it must be safe to use that way; Progress still gets one call at a time
 class Folder {
   public:
     virtual void Save(const std::string &path, bool edit, const void *flag, const Functor<void (std::streambuf &)> &code) = 0;
@@ -70,6 +73,7 @@ class DiskFolder :
 {
   private:
     const std::string path_;
+    std::mutex mutex_;
     std::map<std::string, std::string> commit_;
 
   protected:
@@ -173,6 +177,7 @@ Bundle Sign(const std::string &root, Folder &folder, const Signer &signer, const
 typedef std::map<uint32_t, Hash> Slots;
 
 Hash Sign(const void *idata, size_t isize, std::streambuf &output, const std::string &identifier, const std::string &entitlements, bool merge, const std::string &requirements, const Signer &signer, const Slots &slots, uint32_t flags, uint8_t platform, const Progress &progress);
+Hash Detach(const void *idata, size_t isize, std::streambuf &output, const std::string &identifier, const std::string &entitlements, bool merge, const std::string &requirements, const Signer &signer, const Slots &slots, uint32_t flags, uint8_t platform, const Progress &progress);
 
 }
 